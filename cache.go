@@ -0,0 +1,274 @@
+package lazypdf
+
+/*
+#include "main.h"
+*/
+import "C"
+
+import (
+	"container/list"
+	"context"
+	"crypto/sha256"
+	"encoding/binary"
+	"encoding/hex"
+	"fmt"
+	"os"
+	"path/filepath"
+	"runtime/cgo"
+	"sync"
+	"unsafe"
+)
+
+// Cache stores rendered pages by key. Implementations must be safe for concurrent use. A cache is only an optimization,
+// failures are expected to be handled internally by reporting a miss or dropping the value.
+type Cache interface {
+	Get(key string) ([]byte, bool)
+	Set(key string, value []byte)
+}
+
+// OutputCache sits in front of the renderer. Renders with the same payload and parameters are served from the cache
+// and identical renders in flight are coalesced, so only one of them reaches the C layer and the others wait for its
+// result. The outputs are also indexed by the hash of their pixels, a render that draws the same pixels as a cached
+// output, like an unchanged page of a new version of a document, reuses it instead of encoding the page again. Use it
+// with WithOutputCache.
+type OutputCache struct {
+	cache Cache
+	mutex sync.Mutex
+	calls map[string]*cacheCall
+}
+
+type cacheCall struct {
+	done        chan struct{}
+	value       []byte
+	err         error
+	interrupted bool
+}
+
+// NewOutputCache creates an OutputCache backed by the given cache.
+func NewOutputCache(cache Cache) *OutputCache {
+	return &OutputCache{cache: cache, calls: make(map[string]*cacheCall)}
+}
+
+// do returns the value for the key from the cache or from the render, which is called once for all the concurrent
+// callers with the same key. Only successful renders that are not partial are stored. A caller that waited on a render
+// that was interrupted by the context of another caller renders again with its own. cached is set when the value
+// didn't come from the render of the caller.
+func (c *OutputCache) do(
+	ctx context.Context, key string, render func() (value []byte, partial bool, err error),
+) (value []byte, cached bool, err error) {
+	for {
+		if value, ok := c.cache.Get(key); ok {
+			return value, true, nil
+		}
+
+		c.mutex.Lock()
+		call, ok := c.calls[key]
+		if !ok {
+			call = &cacheCall{done: make(chan struct{})}
+			c.calls[key] = call
+			c.mutex.Unlock()
+			value, err := c.lead(ctx, key, call, render)
+			return value, false, err
+		}
+		c.mutex.Unlock()
+
+		select {
+		case <-call.done:
+		case <-ctx.Done():
+			return nil, false, context.Cause(ctx)
+		}
+		if !call.interrupted {
+			return call.value, true, call.err
+		}
+	}
+}
+
+func (c *OutputCache) lead(
+	ctx context.Context, key string, call *cacheCall, render func() ([]byte, bool, error),
+) ([]byte, error) {
+	// The call is released even if the render panics, the callers waiting on it then render again.
+	call.interrupted = true
+	defer func() {
+		c.mutex.Lock()
+		delete(c.calls, key)
+		c.mutex.Unlock()
+		close(call.done)
+	}()
+
+	value, partial, err := render()
+	call.value, call.err = value, err
+	// A partial render, or one that failed because of the context, is only the answer for the caller that asked for it.
+	call.interrupted = partial || (err != nil && ctx.Err() != nil)
+	if err == nil && !partial {
+		c.cache.Set(key, value)
+	}
+	return value, err
+}
+
+// index records the pixel hash of the output stored at key, in both directions.
+func (c *OutputCache) index(key, pixelHash string) {
+	c.cache.Set(pixelHashKey(pixelHash), []byte(key))
+	c.cache.Set(outputHashKey(key), []byte(pixelHash))
+}
+
+// pixelHash returns the pixel hash of the output stored at key.
+func (c *OutputCache) pixelHash(key string) string {
+	pixelHash, _ := c.cache.Get(outputHashKey(key))
+	return string(pixelHash)
+}
+
+func pixelHashKey(pixelHash string) string {
+	return "pixels:" + pixelHash
+}
+
+func outputHashKey(key string) string {
+	return "hash:" + key
+}
+
+// pixelLookup is the state of a render that is checked against the cache by lookupPixelHash.
+type pixelLookup struct {
+	cache *OutputCache
+	value []byte
+}
+
+// lookupPixelHash is called by the C layer after the page is drawn and before it's encoded. It returns 1 when an output
+// with the same pixels is found at the cache, keeping it at the lookup.
+//
+//export lookupPixelHash
+func lookupPixelHash(handle C.uintptr_t, hash *C.uchar) C.int {
+	lookup := cgo.Handle(handle).Value().(*pixelLookup) // nolint: forcetypeassert
+	key, ok := lookup.cache.cache.Get(pixelHashKey(hex.EncodeToString(C.GoBytes(unsafe.Pointer(hash), 16))))
+	if !ok {
+		return 0
+	}
+	value, ok := lookup.cache.cache.Get(string(key))
+	if !ok {
+		return 0
+	}
+	lookup.value = value
+	return 1
+}
+
+func payloadHash(payload []byte) string {
+	hash := sha256.Sum256(payload)
+	return hex.EncodeToString(hash[:])
+}
+
+// shardKey turns a payload hash into the key that routes its renders to an engine shard, zero when there's no hash.
+func shardKey(payloadHash string) uint64 {
+	hash, err := hex.DecodeString(payloadHash)
+	if err != nil || len(hash) < 8 {
+		return 0
+	}
+	return binary.BigEndian.Uint64(hash)
+}
+
+// cacheKey identifies a render by the hash of the payload and every parameter that changes the output.
+func cacheKey(payloadHash string, page, width uint16, scale float32, dpi int, options renderOptions) string {
+	return fmt.Sprintf(
+		"%s:%d:%d:%g:%d:%d:%d:%t:%g:%dx%d:%d",
+		payloadHash, page, width, scale, dpi, options.colorspace, options.bands, options.skipBlank, options.maxInk,
+		options.fitWidth, options.fitHeight, options.maxPixels,
+	)
+}
+
+// MemoryCache is a Cache that keeps the values in memory up to a size limit, evicting the least recently used ones.
+type MemoryCache struct {
+	mutex   sync.Mutex
+	limit   int
+	size    int
+	entries map[string]*list.Element
+	lru     *list.List
+}
+
+type memoryCacheEntry struct {
+	key   string
+	value []byte
+}
+
+// NewMemoryCache creates a MemoryCache that holds up to limit bytes of values.
+func NewMemoryCache(limit int) *MemoryCache {
+	return &MemoryCache{limit: limit, entries: make(map[string]*list.Element), lru: list.New()}
+}
+
+// Get returns the value for the key and marks it as recently used.
+func (c *MemoryCache) Get(key string) ([]byte, bool) {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	element, ok := c.entries[key]
+	if !ok {
+		return nil, false
+	}
+	c.lru.MoveToFront(element)
+	return element.Value.(*memoryCacheEntry).value, true // nolint: forcetypeassert
+}
+
+// Set stores the value, values larger than the limit are not stored.
+func (c *MemoryCache) Set(key string, value []byte) {
+	if len(value) > c.limit {
+		return
+	}
+
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+	if element, ok := c.entries[key]; ok {
+		c.remove(element)
+	}
+	c.entries[key] = c.lru.PushFront(&memoryCacheEntry{key: key, value: value})
+	c.size += len(value)
+	for c.size > c.limit {
+		c.remove(c.lru.Back())
+	}
+}
+
+func (c *MemoryCache) remove(element *list.Element) {
+	entry := c.lru.Remove(element).(*memoryCacheEntry) // nolint: forcetypeassert
+	delete(c.entries, entry.key)
+	c.size -= len(entry.value)
+}
+
+// DirectoryCache is a Cache that keeps every value as a file at a local directory. There is no eviction, the directory
+// is expected to be cleaned externally.
+type DirectoryCache struct {
+	dir string
+}
+
+// NewDirectoryCache creates a DirectoryCache at dir, creating the directory if needed.
+func NewDirectoryCache(dir string) (*DirectoryCache, error) {
+	if err := os.MkdirAll(dir, 0o750); err != nil {
+		return nil, fmt.Errorf("fail to create the cache directory: %w", err)
+	}
+	return &DirectoryCache{dir: dir}, nil
+}
+
+// Get returns the content of the file of the key.
+func (c *DirectoryCache) Get(key string) ([]byte, bool) {
+	value, err := os.ReadFile(c.path(key))
+	if err != nil {
+		return nil, false
+	}
+	return value, true
+}
+
+// Set writes the value to a temporary file that is then renamed, so readers never see a partial value.
+func (c *DirectoryCache) Set(key string, value []byte) {
+	file, err := os.CreateTemp(c.dir, ".tmp-*")
+	if err != nil {
+		return
+	}
+	_, err = file.Write(value)
+	if closeErr := file.Close(); err == nil {
+		err = closeErr
+	}
+	if err == nil {
+		err = os.Rename(file.Name(), c.path(key))
+	}
+	if err != nil {
+		_ = os.Remove(file.Name())
+	}
+}
+
+func (c *DirectoryCache) path(key string) string {
+	hash := sha256.Sum256([]byte(key))
+	return filepath.Join(c.dir, hex.EncodeToString(hash[:]))
+}
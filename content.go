@@ -0,0 +1,111 @@
+package lazypdf
+
+/*
+#include <jemalloc/jemalloc.h>
+#include "main.h"
+*/
+import "C"
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"io"
+	"unsafe"
+
+	ddTracer "gopkg.in/DataDog/dd-trace-go.v1/ddtrace/tracer"
+)
+
+const defaultInkDPI = 36
+
+// ErrBlankPage is returned by SaveToPNG when WithSkipBlank is set and the page is blank. Nothing is written to the
+// output.
+var ErrBlankPage = errors.New("blank page")
+
+// Rect is an area of a page in points, with the origin at the top left corner.
+type Rect struct {
+	X0, Y0, X1, Y1 float64
+}
+
+// Empty reports whether the rectangle has no area.
+func (r Rect) Empty() bool {
+	return r.X0 >= r.X1 || r.Y0 >= r.Y1
+}
+
+// ContentBounds returns the area of the page covered by anything that is drawn, text, paths or images, without
+// rasterizing it. An empty rectangle means that nothing is drawn at the page.
+func ContentBounds(ctx context.Context, page uint16, rawPayload io.Reader) (_ Rect, err error) {
+	span, _ := ddTracer.StartSpanFromContext(ctx, "lazypdf.ContentBounds")
+	defer func() { span.Finish(ddTracer.WithError(err)) }()
+
+	output, err := pageContent(ctx, page, rawPayload, 0)
+	if err != nil {
+		return Rect{}, err
+	}
+	return contentRect(output), nil
+}
+
+// IsBlank reports whether the page is blank. A page with nothing drawn on it is always blank. When maxInk is above zero,
+// pages with content, like scans, are also rendered in gray at a low resolution and are blank when at most maxInk of
+// their pixels, from 0 to 1, have ink. Neither case encodes the page.
+func IsBlank(ctx context.Context, page uint16, rawPayload io.Reader, maxInk float64) (_ bool, err error) {
+	span, _ := ddTracer.StartSpanFromContext(ctx, "lazypdf.IsBlank")
+	defer func() { span.Finish(ddTracer.WithError(err)) }()
+
+	inkDPI := 0
+	if maxInk > 0 {
+		inkDPI = defaultInkDPI
+	}
+	output, err := pageContent(ctx, page, rawPayload, inkDPI)
+	if err != nil {
+		return false, err
+	}
+	if contentRect(output).Empty() {
+		return true, nil
+	}
+	return maxInk > 0 && float64(output.ink) <= maxInk, nil
+}
+
+func contentRect(output C.page_content_output) Rect {
+	return Rect{
+		X0: float64(output.content.x0),
+		Y0: float64(output.content.y0),
+		X1: float64(output.content.x1),
+		Y1: float64(output.content.y1),
+	}
+}
+
+func pageContent(
+	ctx context.Context, page uint16, rawPayload io.Reader, inkDPI int,
+) (C.page_content_output, error) {
+	if rawPayload == nil {
+		return C.page_content_output{}, errors.New("payload can't be nil")
+	}
+
+	payload, err := io.ReadAll(rawPayload)
+	if err != nil {
+		return C.page_content_output{}, fmt.Errorf("fail to read the payload: %w", err)
+	}
+
+	input := C.page_content_input{
+		page:           C.int(page),
+		payload:        (*C.char)(unsafe.Pointer(&payload[0])),
+		payload_length: C.size_t(len(payload)),
+		ink_dpi:        C.int(inkDPI),
+		cookie:         &C.fz_cookie{abort: 0},
+	}
+	if ctx.Err() != nil {
+		input.cookie.abort = 1
+	}
+	stop := context.AfterFunc(ctx, func() { input.cookie.abort = 1 })
+	defer stop()
+	output := C.page_content(input) // nolint: gocritic
+	if output.error != nil {
+		defer C.je_free(unsafe.Pointer(output.error))
+		if output.aborted != 0 {
+			return output, fmt.Errorf("failure at the C/MuPDF layer: %s: %w", C.GoString(output.error), context.Cause(ctx))
+		}
+		return output, fmt.Errorf("failure at the C/MuPDF layer: %s", C.GoString(output.error))
+	}
+	return output, nil
+}
@@ -1,84 +1,151 @@
 #include <jemalloc/jemalloc.h>
+#include <float.h>
+#include <inttypes.h>
+#include <math.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <time.h>
 #include "main.h"
 
+// Mirrors of private MuPDF structures, used only to read their sizes for the engine stats. They must be checked
+// whenever the MuPDF version at misc/mupdf/version changes.
 typedef struct {
+	int refs;
+	void *head;
+	void *tail;
+	void *hash;
+	size_t max;
 	size_t size;
-#if defined(_M_IA64) || defined(_M_AMD64)
-	size_t align;
-#endif
-} trace_header;
+} store_mirror;
 
 typedef struct {
-	size_t current;
-	size_t peak;
+	int refs;
 	size_t total;
-	size_t allocs;
-	size_t mem_limit;
-	size_t alloc_limit;
-} trace_info;
+} glyph_cache_mirror;
+
+// A MuPDF global lock, aligned to its own cache line so the locks and their counters don't share one.
+typedef struct {
+	pthread_mutex_t mutex;
+	int spins;
+	uint64_t acquired_at;
+	lock_stats stats;
+} __attribute__((aligned(64))) global_lock;
+
+// The engine is split in shards, independent base contexts with their own locks, store and allocator accounting, so
+// renders at different shards never contend on MuPDF state. There is a single shard unless LAZYPDF_SHARDS is set, the
+// default store budget is split between them. Renders of a document with a known hash always go to the same shard, for
+// the locality of its store, everything else is spread round-robin.
+typedef struct {
+	fz_context *ctx;
+	fz_locks_context locks;
+	fz_alloc_context alloc;
+	global_lock *mutex;
+	trace_info info;
+} engine_shard;
+
+static engine_shard *shards = NULL;
+static unsigned shards_count = 0;
+static unsigned shards_next = 0;
+
+static int active_renders = 0;
+static int active_page_counts = 0;
+
+// The allocations made on behalf of a render are tracked per thread, at the thread running it and at the run_parallel
+// workers drawing for it, which share its trace. The counters are atomic as the workers allocate at the same time.
+typedef struct {
+	render_memory *memory;
+	int64_t current;
+} render_trace;
+
+static __thread render_trace *thread_render_trace = NULL;
+
+static void trace_render(int64_t delta, size_t total, size_t allocs) {
+	render_trace *trace = thread_render_trace;
+	if (trace == NULL)
+		return;
+	int64_t current = __atomic_add_fetch(&trace->current, delta, __ATOMIC_RELAXED);
+	size_t peak = __atomic_load_n(&trace->memory->peak, __ATOMIC_RELAXED);
+	while (current > 0 && (size_t)current > peak &&
+		!__atomic_compare_exchange_n(&trace->memory->peak, &peak, (size_t)current, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_add_fetch(&trace->memory->total, total, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&trace->memory->allocs, allocs, __ATOMIC_RELAXED);
+}
+
+static void trace_render_start(render_trace *trace, render_memory *memory) {
+	*memory = (render_memory){0};
+	trace->memory = memory;
+	trace->current = 0;
+	thread_render_trace = trace;
+}
 
-fz_context *global_ctx;
-fz_locks_context *global_ctx_lock;
-pthread_mutex_t *global_ctx_mutex;
-trace_info *tinfo;
-fz_alloc_context *trace_alloc_ctx;
+static void trace_render_stop() {
+	thread_render_trace = NULL;
+}
 
+// The allocator doesn't keep a header with the size of each block, jemalloc already knows it. The accounting is based
+// on the usable size of the blocks, which is what is actually taken from jemalloc, and the frees are sized.
 static void *trace_malloc(void *arg, size_t size) {
 	trace_info *info = (trace_info *) arg;
-	trace_header *p;
+	void *p;
+	size_t usable;
 	if (size == 0)
 		return NULL;
-	if (size > SIZE_MAX - sizeof(trace_header))
-		return NULL;
-	p = je_malloc(size + sizeof(trace_header));
+	p = je_malloc(size);
 	if (p == NULL)
 		return NULL;
-	p[0].size = size;
-	info->current += size;
-	info->total += size;
+	usable = je_sallocx(p, 0);
+	info->current += usable;
+	info->total += usable;
 	if (info->current > info->peak)
 		info->peak = info->current;
 	info->allocs++;
-	return (void *)&p[1];
+	trace_render(usable, usable, 1);
+	return p;
 }
 
-static void trace_free(void *arg, void *p_) {
+static void trace_free(void *arg, void *p) {
 	trace_info *info = (trace_info *) arg;
-	trace_header *p = (trace_header *)p_;
+	size_t usable;
 
 	if (p == NULL)
 		return;
-	info->current -= p[-1].size;
-	je_free(&p[-1]);
+	usable = je_sallocx(p, 0);
+	info->current -= usable;
+	trace_render(-(int64_t)usable, 0, 0);
+	je_sdallocx(p, usable, 0);
 }
 
-static void *trace_realloc(void *arg, void *p_, size_t size) {
+static void *trace_realloc(void *arg, void *p, size_t size) {
 	trace_info *info = (trace_info *) arg;
-	trace_header *p = (trace_header *)p_;
-	size_t oldsize;
+	size_t oldsize, newsize;
 
 	if (size == 0) {
-		trace_free(arg, p_);
+		trace_free(arg, p);
 		return NULL;
 	}
 	if (p == NULL)
 		return trace_malloc(arg, size);
-	if (size > SIZE_MAX - sizeof(trace_header))
-		return NULL;
-	oldsize = p[-1].size;
-	p = je_realloc(&p[-1], size + sizeof(trace_header));
+	oldsize = je_sallocx(p, 0);
+	p = je_realloc(p, size);
 	if (p == NULL)
 		return NULL;
-	info->current += size - oldsize;
-	if (size > oldsize)
-		info->total += size - oldsize;
+	newsize = je_sallocx(p, 0);
+	info->current += newsize - oldsize;
+	if (newsize > oldsize)
+		info->total += newsize - oldsize;
 	if (info->current > info->peak)
 		info->peak = info->current;
-	p[0].size = size;
 	info->allocs++;
-	return &p[1];
+	trace_render((int64_t)newsize - (int64_t)oldsize, newsize > oldsize ? newsize - oldsize : 0, 1);
+	return p;
+}
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
 
 void fail(char *msg) {
@@ -86,64 +153,633 @@ void fail(char *msg) {
 	abort();
 }
 
-void lock_mutex(void *user, int lock) {
-	pthread_mutex_t *mutex = (pthread_mutex_t *) user;
-	if (pthread_mutex_lock(&mutex[lock]) != 0) {
+// Every cloned context shares the MuPDF global locks, the alloc one is taken on every allocation. With
+// LAZYPDF_LOCKS=spin a contended lock is retried for a while before the thread blocks, the spin budget of each lock
+// adapts to how long it was held recently, like the glibc adaptive mutexes. With LAZYPDF_LOCK_STATS=1 the
+// acquisitions, the time spent waiting and holding each lock are recorded. The counters are only written by the holder
+// of the lock, relaxed atomics are enough for the stats to read them.
+#define LOCK_SPIN_MAX 100
+
+static int lock_spinning = 0;
+static int lock_instrumented = 0;
+
+static inline void stat_add(uint64_t *counter, uint64_t delta) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static void acquire_lock(global_lock *lock) {
+	if (lock_spinning) {
+		int spins = __atomic_load_n(&lock->spins, __ATOMIC_RELAXED);
+		int limit = spins * 2 + 10 < LOCK_SPIN_MAX ? spins * 2 + 10 : LOCK_SPIN_MAX;
+		int count = 0;
+		while (pthread_mutex_trylock(&lock->mutex) != 0) {
+			if (count++ >= limit) {
+				if (pthread_mutex_lock(&lock->mutex) != 0) {
+					fail("pthread_mutex_lock()");
+				}
+				break;
+			}
+			cpu_relax();
+		}
+		__atomic_store_n(&lock->spins, spins + (count - spins) / 8, __ATOMIC_RELAXED);
+		return;
+	}
+	if (pthread_mutex_lock(&lock->mutex) != 0) {
 		fail("pthread_mutex_lock()");
 	}
 }
 
+void lock_mutex(void *user, int lock) {
+	global_lock *l = &((global_lock *) user)[lock];
+	if (!lock_instrumented) {
+		acquire_lock(l);
+		return;
+	}
+
+	uint64_t now;
+	if (pthread_mutex_trylock(&l->mutex) == 0) {
+		now = now_ns();
+	} else {
+		uint64_t start = now_ns();
+		acquire_lock(l);
+		now = now_ns();
+		stat_add(&l->stats.contended, 1);
+		stat_add(&l->stats.wait_ns, now - start);
+	}
+	stat_add(&l->stats.acquisitions, 1);
+	l->acquired_at = now;
+}
+
 void unlock_mutex(void *user, int lock) {
-	pthread_mutex_t *mutex = (pthread_mutex_t *) user;
-	if (pthread_mutex_unlock(&mutex[lock]) != 0) {
+	global_lock *l = &((global_lock *) user)[lock];
+	if (lock_instrumented) {
+		stat_add(&l->stats.hold_ns, now_ns() - l->acquired_at);
+	}
+	if (pthread_mutex_unlock(&l->mutex) != 0) {
 		fail("pthread_mutex_unlock()");
 	}
 }
 
-void init() {
-	global_ctx_mutex = je_malloc(sizeof(pthread_mutex_t) * FZ_LOCK_MAX);
+static void init_locks() {
+	char *env = getenv("LAZYPDF_LOCKS");
+	if (env != NULL && strcmp(env, "spin") == 0) {
+		lock_spinning = 1;
+	}
+	env = getenv("LAZYPDF_LOCK_STATS");
+	if (env != NULL && strcmp(env, "1") == 0) {
+		lock_instrumented = 1;
+	}
+}
+
+static global_lock *new_locks() {
+	global_lock *locks;
+	if (je_posix_memalign((void **) &locks, sizeof(global_lock), sizeof(global_lock) * FZ_LOCK_MAX) != 0) {
+		fail("je_posix_memalign()");
+	}
+	memset(locks, 0, sizeof(global_lock) * FZ_LOCK_MAX);
 	for (size_t i = 0; i < FZ_LOCK_MAX; i++) {
-		if (pthread_mutex_init(&global_ctx_mutex[i], NULL) != 0) {
+		if (pthread_mutex_init(&locks[i].mutex, NULL) != 0) {
 			fail("pthread_mutex_init()");
 		}
 	}
+	return locks;
+}
 
-	global_ctx_lock = je_malloc(sizeof(fz_locks_context));
-	global_ctx_lock->user = global_ctx_mutex;
-	global_ctx_lock->lock = lock_mutex;
-	global_ctx_lock->unlock = unlock_mutex;
+// The pixmap pool keeps the sample buffers of finished renders to be reused by the next ones, saving a large
+// allocation and the page faults that come with it on every render. Buffers are grouped in size classes, four per power
+// of two, so a buffer is at most 25% bigger than requested. The buffers are allocated through the tracing allocator
+// and the pool retains at most pixmap_pool.limit bytes. A buffer may be freed by a render at another shard than the
+// one it was allocated for, so the pool keeps its own allocator accounting, guarded by its mutex like the rest of it.
+#define PIXMAP_POOL_MIN_SIZE (64 * 1024)
+#define PIXMAP_POOL_CLASSES (64 * 4)
 
-	tinfo = je_malloc(sizeof(trace_info));
-	tinfo->current = 0;
-	tinfo->peak = 0;
-	tinfo->total = 0;
-	tinfo->allocs = 0;
-	tinfo->mem_limit = 0;
-	tinfo->alloc_limit = 0;
+typedef struct pool_buffer {
+	struct pool_buffer *next;
+} pool_buffer;
 
-	trace_alloc_ctx = je_malloc(sizeof(fz_alloc_context));
-	trace_alloc_ctx->user = tinfo;
-	trace_alloc_ctx->malloc = trace_malloc;
-	trace_alloc_ctx->realloc = trace_realloc;
-	trace_alloc_ctx->free = trace_free;
+static struct {
+	pthread_mutex_t mutex;
+	pool_buffer *free[PIXMAP_POOL_CLASSES];
+	size_t limit;
+	size_t retained;
+	size_t hits;
+	size_t misses;
+	trace_info info;
+} pixmap_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.limit = 64 * 1024 * 1024,
+};
 
-	global_ctx = fz_new_context(trace_alloc_ctx, global_ctx_lock, FZ_STORE_DEFAULT);
-	fz_register_document_handlers(global_ctx);
-	fz_set_error_callback(global_ctx, NULL, NULL);
-	fz_set_warning_callback(global_ctx, NULL, NULL);
+static int pixmap_pool_class(size_t size, size_t *class_size) {
+	int exponent = 63 - __builtin_clzll(size);
+	size_t step = (size_t)1 << (exponent - 2);
+	size_t rounded = (size + step - 1) & ~(step - 1);
+	*class_size = rounded;
+	exponent = 63 - __builtin_clzll(rounded);
+	return exponent * 4 + (int)((rounded >> (exponent - 2)) & 3);
 }
 
-page_count_output page_count(page_count_input input) {
-	page_count_output output;
-	output.count = 0;
-	output.error = NULL;
+static void *pixmap_pool_acquire(fz_context *ctx, size_t size, size_t *class_size) {
+	if (size < PIXMAP_POOL_MIN_SIZE) {
+		return NULL;
+	}
+	int class = pixmap_pool_class(size, class_size);
 
-	fz_context *ctx = fz_clone_context(global_ctx);
-	if (ctx == NULL) {
-		output.error = strdup("fail to create a context");
-		return output;
+	pthread_mutex_lock(&pixmap_pool.mutex);
+	if (*class_size > pixmap_pool.limit) {
+		pthread_mutex_unlock(&pixmap_pool.mutex);
+		return NULL;
+	}
+	void *samples = pixmap_pool.free[class];
+	if (samples != NULL) {
+		pixmap_pool.free[class] = ((pool_buffer *) samples)->next;
+		pixmap_pool.retained -= *class_size;
+		pixmap_pool.hits++;
+	} else {
+		pixmap_pool.misses++;
+		samples = trace_malloc(&pixmap_pool.info, *class_size);
+	}
+	pthread_mutex_unlock(&pixmap_pool.mutex);
+	if (samples == NULL) {
+		fz_throw(ctx, FZ_ERROR_SYSTEM, "cannot allocate pixmap samples of %zu bytes", *class_size);
+	}
+	return samples;
+}
+
+static void pixmap_pool_free(void *samples) {
+	pthread_mutex_lock(&pixmap_pool.mutex);
+	trace_free(&pixmap_pool.info, samples);
+	pthread_mutex_unlock(&pixmap_pool.mutex);
+}
+
+static void pixmap_pool_release(void *samples, size_t class_size) {
+	if (samples == NULL) {
+		return;
+	}
+	size_t ignored;
+	int class = pixmap_pool_class(class_size, &ignored);
+
+	pthread_mutex_lock(&pixmap_pool.mutex);
+	if (pixmap_pool.retained + class_size <= pixmap_pool.limit) {
+		pool_buffer *buffer = (pool_buffer *) samples;
+		buffer->next = pixmap_pool.free[class];
+		pixmap_pool.free[class] = buffer;
+		pixmap_pool.retained += class_size;
+		samples = NULL;
+	}
+	pthread_mutex_unlock(&pixmap_pool.mutex);
+
+	if (samples != NULL) {
+		pixmap_pool_free(samples);
+	}
+}
+
+void set_pixmap_pool_limit(size_t limit) {
+	pool_buffer *evicted = NULL;
+
+	pthread_mutex_lock(&pixmap_pool.mutex);
+	pixmap_pool.limit = limit;
+	for (int class = PIXMAP_POOL_CLASSES - 1; class >= 0 && pixmap_pool.retained > limit; class--) {
+		size_t class_size = ((size_t)4 | (class & 3)) << (class / 4 - 2);
+		while (pixmap_pool.free[class] != NULL && pixmap_pool.retained > limit) {
+			pool_buffer *buffer = pixmap_pool.free[class];
+			pixmap_pool.free[class] = buffer->next;
+			pixmap_pool.retained -= class_size;
+			buffer->next = evicted;
+			evicted = buffer;
+		}
+	}
+	pthread_mutex_unlock(&pixmap_pool.mutex);
+
+	while (evicted != NULL) {
+		pool_buffer *next = evicted->next;
+		pixmap_pool_free(evicted);
+		evicted = next;
+	}
+}
+
+// The glyph cache is shared by every render of a shard. MuPDF empties it whenever a document is dropped and once it
+// holds more than 1 MiB, a compile time constant, so it only lives for the duration of the renders in flight.
+static size_t glyph_cache_size(engine_shard *shard) {
+	lock_mutex(shard->mutex, FZ_LOCK_GLYPHCACHE);
+	size_t size = ((glyph_cache_mirror *) shard->ctx->glyph_cache)->total;
+	unlock_mutex(shard->mutex, FZ_LOCK_GLYPHCACHE);
+	return size;
+}
+
+void purge_glyph_cache() {
+	for (unsigned i = 0; i < shards_count; i++) {
+		fz_context *ctx = fz_clone_context(shards[i].ctx);
+		if (ctx == NULL) {
+			continue;
+		}
+		fz_purge_glyph_cache(ctx);
+		fz_drop_context(ctx);
+	}
+}
+
+// MuPDF allocations are served by dedicated jemalloc arenas, so their fragmentation and decay are isolated from the
+// rest of the process. Each thread calling into the engine is bound to one of them, round-robin, the first time it
+// renders. The number of arenas defaults to the number of CPUs and can be set with LAZYPDF_ARENAS, where 0 keeps the
+// jemalloc default arenas.
+static unsigned *arenas = NULL;
+static unsigned arenas_count = 0;
+static unsigned arenas_next = 0;
+static __thread int thread_arena_bound = 0;
+
+static void init_arenas() {
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	char *env = getenv("LAZYPDF_ARENAS");
+	if (env != NULL) {
+		count = strtol(env, NULL, 10);
+	}
+	if (count <= 0) {
+		return;
+	}
+
+	arenas = je_malloc(sizeof(unsigned) * count);
+	for (long i = 0; i < count; i++) {
+		size_t length = sizeof(unsigned);
+		if (je_mallctl("arenas.create", &arenas[i], &length, NULL, 0) != 0) {
+			fail("je_mallctl(arenas.create)");
+		}
+	}
+	arenas_count = count;
+}
+
+static void bind_thread_arena() {
+	if (arenas_count == 0 || thread_arena_bound) {
+		return;
+	}
+	unsigned arena = arenas[__atomic_fetch_add(&arenas_next, 1, __ATOMIC_RELAXED) % arenas_count];
+	if (je_mallctl("thread.arena", NULL, NULL, &arena, sizeof(arena)) != 0) {
+		fail("je_mallctl(thread.arena)");
+	}
+	thread_arena_bound = 1;
+}
+
+static int arenas_mallctl(const char *format, void *value, size_t length) {
+	int result = 0;
+	for (unsigned i = 0; i < arenas_count; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), format, arenas[i]);
+		if (je_mallctl(name, NULL, NULL, value, length) != 0) {
+			result = -1;
+		}
+	}
+	return result;
+}
+
+int set_arenas_decay(ssize_t dirty_decay_ms, ssize_t muzzy_decay_ms) {
+	if (arenas_mallctl("arena.%u.dirty_decay_ms", &dirty_decay_ms, sizeof(dirty_decay_ms)) != 0) {
+		return -1;
+	}
+	return arenas_mallctl("arena.%u.muzzy_decay_ms", &muzzy_decay_ms, sizeof(muzzy_decay_ms));
+}
+
+void purge_arenas() {
+	arenas_mallctl("arena.%u.purge", NULL, 0);
+}
+
+static void init_shards() {
+	long count = 1;
+	char *env = getenv("LAZYPDF_SHARDS");
+	if (env != NULL && strtol(env, NULL, 10) > 1) {
+		count = strtol(env, NULL, 10);
+	}
+	shards = je_calloc(count, sizeof(engine_shard));
+	shards_count = count;
+	for (long i = 0; i < count; i++) {
+		engine_shard *shard = &shards[i];
+		shard->mutex = new_locks();
+		shard->locks.user = shard->mutex;
+		shard->locks.lock = lock_mutex;
+		shard->locks.unlock = unlock_mutex;
+		shard->alloc.user = &shard->info;
+		shard->alloc.malloc = trace_malloc;
+		shard->alloc.realloc = trace_realloc;
+		shard->alloc.free = trace_free;
+
+		shard->ctx = fz_new_context(&shard->alloc, &shard->locks, FZ_STORE_DEFAULT / count);
+		if (shard->ctx == NULL) {
+			fail("fz_new_context()");
+		}
+		fz_register_document_handlers(shard->ctx);
+		fz_set_error_callback(shard->ctx, NULL, NULL);
+		fz_set_warning_callback(shard->ctx, NULL, NULL);
+	}
+}
+
+static engine_shard *pick_shard(uint64_t key) {
+	if (key == 0) {
+		key = __atomic_fetch_add(&shards_next, 1, __ATOMIC_RELAXED);
+	}
+	return &shards[key % shards_count];
+}
+
+// Every call used to clone the shard context and drop it at the end. Now each thread keeps a clone per shard, made the
+// first time it calls into the engine and dropped when the thread exits. Go reuses its OS threads, so after warming up
+// no call pays for the clone. A call made while the clone of the thread is in use, from a Go callback, gets its own.
+typedef struct {
+	fz_context *ctx;
+	int busy;
+} thread_context;
+
+static pthread_key_t thread_contexts_key;
+static __thread thread_context *thread_contexts = NULL;
+
+static void drop_thread_contexts(void *arg) {
+	thread_context *contexts = arg;
+	for (unsigned i = 0; i < shards_count; i++) {
+		if (contexts[i].ctx != NULL) {
+			fz_drop_context(contexts[i].ctx);
+		}
+	}
+	je_free(contexts);
+}
+
+static void init_thread_contexts() {
+	if (pthread_key_create(&thread_contexts_key, drop_thread_contexts) != 0) {
+		fail("pthread_key_create()");
+	}
+}
+
+static fz_context *acquire_context(engine_shard *shard) {
+	if (thread_contexts == NULL) {
+		thread_context *contexts = je_calloc(shards_count, sizeof(thread_context));
+		if (contexts == NULL || pthread_setspecific(thread_contexts_key, contexts) != 0) {
+			je_free(contexts);
+			return fz_clone_context(shard->ctx);
+		}
+		thread_contexts = contexts;
+	}
+	thread_context *cached = &thread_contexts[shard - shards];
+	if (cached->busy) {
+		return fz_clone_context(shard->ctx);
+	}
+	if (cached->ctx == NULL) {
+		cached->ctx = fz_clone_context(shard->ctx);
+		if (cached->ctx == NULL) {
+			return NULL;
+		}
+	}
+	cached->busy = 1;
+	return cached->ctx;
+}
+
+static void release_context(engine_shard *shard, fz_context *ctx) {
+	if (thread_contexts != NULL && thread_contexts[shard - shards].ctx == ctx) {
+		thread_contexts[shard - shards].busy = 0;
+		return;
+	}
+	fz_drop_context(ctx);
+}
+
+void init() {
+	init_arenas();
+	init_locks();
+	init_shards();
+	init_thread_contexts();
+}
+
+static void parallel_queue_stats(int *tasks, int *calls);
+
+static size_t mallctl_size(const char *name) {
+	size_t value = 0;
+	size_t length = sizeof(value);
+	if (je_mallctl(name, &value, &length, NULL, 0) != 0) {
+		return 0;
+	}
+	return value;
+}
+
+engine_stats get_engine_stats() {
+	engine_stats stats;
+
+	// Shards and the pixmap pool are summed, the peak is the sum of the peak of each one.
+	memset(&stats.memory, 0, sizeof(stats.memory));
+	stats.store_max = 0;
+	stats.store_size = 0;
+	stats.glyph_cache_size = 0;
+	for (unsigned i = 0; i < shards_count; i++) {
+		engine_shard *shard = &shards[i];
+		lock_mutex(shard->mutex, FZ_LOCK_ALLOC);
+		stats.memory.current += shard->info.current;
+		stats.memory.peak += shard->info.peak;
+		stats.memory.total += shard->info.total;
+		stats.memory.allocs += shard->info.allocs;
+		store_mirror *store = (store_mirror *) shard->ctx->store;
+		stats.store_max += store->max;
+		stats.store_size += store->size;
+		unlock_mutex(shard->mutex, FZ_LOCK_ALLOC);
+
+		stats.glyph_cache_size += glyph_cache_size(shard);
+	}
+	stats.shards = shards_count;
+
+	// jemalloc caches its statistics, they're only refreshed when the epoch is advanced.
+	uint64_t epoch = 1;
+	size_t epoch_length = sizeof(epoch);
+	je_mallctl("epoch", &epoch, &epoch_length, &epoch, epoch_length);
+	stats.allocated = mallctl_size("stats.allocated");
+	stats.active = mallctl_size("stats.active");
+	stats.resident = mallctl_size("stats.resident");
+	stats.retained = mallctl_size("stats.retained");
+	stats.mapped = mallctl_size("stats.mapped");
+
+	size_t page = mallctl_size("arenas.page");
+	stats.arenas = arenas_count;
+	stats.arenas_dirty = 0;
+	stats.arenas_muzzy = 0;
+	for (unsigned i = 0; i < arenas_count; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "stats.arenas.%u.pdirty", arenas[i]);
+		stats.arenas_dirty += mallctl_size(name) * page;
+		snprintf(name, sizeof(name), "stats.arenas.%u.pmuzzy", arenas[i]);
+		stats.arenas_muzzy += mallctl_size(name) * page;
+	}
+
+	pthread_mutex_lock(&pixmap_pool.mutex);
+	stats.memory.current += pixmap_pool.info.current;
+	stats.memory.peak += pixmap_pool.info.peak;
+	stats.memory.total += pixmap_pool.info.total;
+	stats.memory.allocs += pixmap_pool.info.allocs;
+	stats.pixmap_pool_limit = pixmap_pool.limit;
+	stats.pixmap_pool_retained = pixmap_pool.retained;
+	stats.pixmap_pool_hits = pixmap_pool.hits;
+	stats.pixmap_pool_misses = pixmap_pool.misses;
+	pthread_mutex_unlock(&pixmap_pool.mutex);
+
+	stats.lock_spinning = lock_spinning;
+	stats.lock_instrumented = lock_instrumented;
+	memset(stats.locks, 0, sizeof(stats.locks));
+	for (unsigned i = 0; i < shards_count; i++) {
+		for (int j = 0; j < FZ_LOCK_MAX; j++) {
+			lock_stats *lock = &shards[i].mutex[j].stats;
+			stats.locks[j].acquisitions += __atomic_load_n(&lock->acquisitions, __ATOMIC_RELAXED);
+			stats.locks[j].contended += __atomic_load_n(&lock->contended, __ATOMIC_RELAXED);
+			stats.locks[j].wait_ns += __atomic_load_n(&lock->wait_ns, __ATOMIC_RELAXED);
+			stats.locks[j].hold_ns += __atomic_load_n(&lock->hold_ns, __ATOMIC_RELAXED);
+		}
+	}
+
+	stats.active_renders = __atomic_load_n(&active_renders, __ATOMIC_RELAXED);
+	stats.active_page_counts = __atomic_load_n(&active_page_counts, __ATOMIC_RELAXED);
+	parallel_queue_stats(&stats.queued_tasks, &stats.queued_calls);
+	return stats;
+}
+
+void reset_trace_peak() {
+	for (unsigned i = 0; i < shards_count; i++) {
+		lock_mutex(shards[i].mutex, FZ_LOCK_ALLOC);
+		shards[i].info.peak = shards[i].info.current;
+		unlock_mutex(shards[i].mutex, FZ_LOCK_ALLOC);
+	}
+	pthread_mutex_lock(&pixmap_pool.mutex);
+	pixmap_pool.info.peak = pixmap_pool.info.current;
+	pthread_mutex_unlock(&pixmap_pool.mutex);
+}
+
+// A reader stream reads the payload on demand through Go, so only the ranges MuPDF touches are fetched. The reads are
+// aligned to blocks kept at a small LRU cache as MuPDF goes back and forth over the same areas, like the xref.
+#define READER_BLOCK_SIZE (64 * 1024)
+#define READER_BLOCKS 64
+
+typedef struct {
+	int64_t offset;
+	size_t length;
+	uint64_t used;
+	unsigned char *data;
+} reader_block;
+
+typedef struct {
+	uintptr_t handle;
+	int64_t size;
+	// Reads from the limit on fail with a try later error, MuPDF's signal that a progressive stream has no data there
+	// yet.
+	int64_t limit;
+	uint64_t clock;
+	reader_block blocks[READER_BLOCKS];
+} reader_state;
+
+static reader_block *reader_fetch(fz_context *ctx, reader_state *state, int64_t offset) {
+	reader_block *victim = &state->blocks[0];
+	for (int i = 0; i < READER_BLOCKS; i++) {
+		reader_block *block = &state->blocks[i];
+		if (block->data != NULL && block->offset == offset) {
+			block->used = ++state->clock;
+			return block;
+		}
+		if (block->used < victim->used) {
+			victim = block;
+		}
+	}
+
+	if (victim->data == NULL) {
+		victim->data = fz_malloc(ctx, READER_BLOCK_SIZE);
+	}
+	victim->offset = -1;
+	victim->used = 0;
+	int64_t length = readPayloadAt(state->handle, victim->data, fz_mini64(READER_BLOCK_SIZE, state->size - offset), offset);
+	if (length < 0) {
+		fz_throw(ctx, FZ_ERROR_SYSTEM, "cannot read the payload at %" PRId64, offset);
+	}
+	victim->offset = offset;
+	victim->length = (size_t) length;
+	victim->used = ++state->clock;
+	return victim;
+}
+
+static int next_reader(fz_context *ctx, fz_stream *stm, size_t max) {
+	reader_state *state = stm->state;
+	if (stm->pos >= state->size) {
+		return EOF;
+	}
+	if (stm->pos >= state->limit) {
+		fz_throw(ctx, FZ_ERROR_TRYLATER, "the payload is only read up to %" PRId64, state->limit);
+	}
+
+	int64_t offset = stm->pos - stm->pos % READER_BLOCK_SIZE;
+	reader_block *block = reader_fetch(ctx, state, offset);
+	if ((int64_t) block->length <= stm->pos - offset) {
+		return EOF;
+	}
+	int64_t length = fz_mini64((int64_t) block->length, state->limit - offset);
+	stm->rp = block->data + (stm->pos - offset);
+	stm->wp = block->data + length;
+	stm->pos = offset + length;
+	return *stm->rp++;
+}
+
+static void seek_reader(fz_context *ctx, fz_stream *stm, int64_t offset, int whence) {
+	reader_state *state = stm->state;
+	if (whence == SEEK_END) {
+		offset += state->size;
+	} else if (whence == SEEK_CUR) {
+		offset += stm->pos - (stm->wp - stm->rp);
+	}
+	stm->pos = fz_clamp64(offset, 0, state->size);
+	stm->rp = stm->wp;
+}
+
+static void drop_reader(fz_context *ctx, void *arg) {
+	reader_state *state = arg;
+	for (int i = 0; i < READER_BLOCKS; i++) {
+		fz_free(ctx, state->blocks[i].data);
+	}
+	fz_free(ctx, state);
+}
+
+// open_payload opens the payload from memory or, when reader is set, through the reader stream.
+static fz_stream *open_payload(fz_context *ctx, const char *payload, size_t payload_length, uintptr_t reader) {
+	if (reader == 0) {
+		return fz_open_memory(ctx, (const unsigned char *)payload, payload_length);
+	}
+
+	reader_state *state = fz_malloc_struct(ctx, reader_state);
+	state->handle = reader;
+	state->size = (int64_t) payload_length;
+	state->limit = state->size;
+	fz_stream *stream = fz_new_stream(ctx, state, next_reader, drop_reader);
+	stream->seek = seek_reader;
+	return stream;
+}
+
+// first_page_end returns where the first page section of a linearized payload ends, as told by the linearization
+// dictionary at its first kilobyte, or 0 when the payload is not linearized. The stream is left at its start.
+static int64_t first_page_end(fz_context *ctx, fz_stream *stream) {
+	char head[1025];
+	size_t length = fz_read(ctx, stream, (unsigned char *) head, sizeof(head) - 1);
+	fz_seek(ctx, stream, 0, SEEK_SET);
+	// The header is followed by binary bytes, which may be zeros.
+	for (size_t i = 0; i < length; i++) {
+		if (head[i] == 0) {
+			head[i] = ' ';
+		}
+	}
+	head[length] = 0;
+
+	char *dict = strstr(head, "/Linearized");
+	if (dict == NULL) {
+		return 0;
+	}
+	char *end = strstr(dict, "/E");
+	char *close = strstr(dict, ">>");
+	if (end == NULL || (close != NULL && end > close)) {
+		return 0;
 	}
+	return fz_maxi64(strtoll(end + 2, NULL, 10), 0);
+}
 
+static void count_pages(fz_context *ctx, page_count_input input, page_count_output *output) {
 	fz_stream *stream = NULL;
 	pdf_document *doc = NULL;
 
@@ -151,16 +787,41 @@ page_count_output page_count(page_count_input input) {
 	fz_var(doc);
 
 	fz_try(ctx) {
-		stream = fz_open_memory(ctx, (const unsigned char *)input.payload, input.payload_length);
+		uint64_t mark = now_ns();
+		stream = open_payload(ctx, input.payload, input.payload_length, input.payload_reader);
 		doc = pdf_open_document_with_stream(ctx, stream);
-		output.count = pdf_count_pages(ctx, doc);
+		output->timings.open = now_ns() - mark;
+
+		mark = now_ns();
+		output->count = pdf_count_pages(ctx, doc);
+		output->timings.load = now_ns() - mark;
 	} fz_always(ctx) {
 		pdf_drop_document(ctx, doc);
 		fz_drop_stream(ctx, stream);
-  } fz_catch(ctx) {
-		output.error = strdup(fz_caught_message(ctx));
+	} fz_catch(ctx) {
+		output->error = strdup(fz_caught_message(ctx));
 	}
-	fz_drop_context(ctx);
+}
+
+page_count_output page_count(page_count_input input) {
+	page_count_output output;
+	output.count = 0;
+	output.timings = (phase_timings){0};
+	output.error = NULL;
+
+	bind_thread_arena();
+	__atomic_add_fetch(&active_page_counts, 1, __ATOMIC_RELAXED);
+	engine_shard *shard = pick_shard(0);
+	fz_context *ctx = acquire_context(shard);
+	if (ctx == NULL) {
+		__atomic_sub_fetch(&active_page_counts, 1, __ATOMIC_RELAXED);
+		output.error = strdup("fail to create a context");
+		return output;
+	}
+
+	count_pages(ctx, input, &output);
+	release_context(shard, ctx);
+	__atomic_sub_fetch(&active_page_counts, 1, __ATOMIC_RELAXED);
 
 	return output;
 }
@@ -201,81 +862,1143 @@ int get_rotation(fz_context *ctx, pdf_page *page) {
 	return pdf_to_int(ctx, pdf_lookup_inherited_page_item(ctx, page_obj, PDF_NAME(Rotate)));
 }
 
-save_to_png_output save_to_png(save_to_png_input input) {
-	save_to_png_output output;
-	output.payload = NULL;
-	output.payload_length = 0;
-	output.error = NULL;
+// page_scale_factor returns the scale used to render a page, the rules are described at SaveToPNG.
+static float page_scale_factor(fz_context *ctx, pdf_page *page, fz_rect bounds, int width, float scale) {
+	if (width != 0) {
+		return width / bounds.x1;
+	}
+	if (scale != 0) {
+		return scale;
+	}
+	if ((bounds.x1 - bounds.x0) > (bounds.y1 - bounds.y0)) {
+		switch (get_rotation(ctx, page)) {
+			case 0:
+			case 180:
+				return 1;
+		}
+	}
+	return 1.5;
+}
 
-	fz_context *ctx = fz_clone_context(global_ctx);
-	if (ctx == NULL) {
-		output.error = strdup("fail to create a context");
-		return output;
+static fz_matrix page_ctm(float scale_factor, int dpi) {
+	float resolution = (float)(dpi) / 72;
+	return fz_concat(fz_scale(resolution, resolution), fz_scale(scale_factor, scale_factor));
+}
+
+// fit_scale_factor returns the scale at which the page, at the given resolution, fits within width x height pixels. A
+// zero dimension is unbounded.
+static float fit_scale_factor(fz_rect bounds, int width, int height, int dpi) {
+	float resolution = (float)(dpi) / 72;
+	float page_width = (bounds.x1 - bounds.x0) * resolution;
+	float page_height = (bounds.y1 - bounds.y0) * resolution;
+	float scale = FLT_MAX;
+	if (width > 0 && page_width > 0) {
+		scale = fz_min(scale, width / page_width);
+	}
+	if (height > 0 && page_height > 0) {
+		scale = fz_min(scale, height / page_height);
 	}
+	return scale == FLT_MAX ? 1 : scale;
+}
 
-	fz_stream *stream = NULL;
-	pdf_document *doc = NULL;
-	pdf_page *page = NULL;
-	fz_device *device = NULL;
-	fz_pixmap *pixmap = NULL;
-	fz_buffer *buffer = NULL;
+static uint64_t bbox_pixels(fz_irect bbox) {
+	return (uint64_t)(bbox.x1 - bbox.x0) * (uint64_t)(bbox.y1 - bbox.y0);
+}
 
-	fz_var(stream);
-	fz_var(doc);
-	fz_var(page);
-	fz_var(device);
-	fz_var(pixmap);
+// clamp_ctm scales the ctm down until the page takes at most max_pixels, it returns 1 when it had to. The rounding of
+// the bbox may add a row or column, so the factor is applied again until it fits.
+static int clamp_ctm(fz_rect bounds, uint64_t max_pixels, fz_matrix *ctm, fz_irect *bbox) {
+	if (max_pixels == 0 || bbox_pixels(*bbox) <= max_pixels) {
+		return 0;
+	}
+	for (int i = 0; i < 8 && bbox_pixels(*bbox) > max_pixels; i++) {
+		float factor = sqrtf((float) max_pixels / bbox_pixels(*bbox)) * 0.999f;
+		*ctm = fz_concat(*ctm, fz_scale(factor, factor));
+		*bbox = fz_round_rect(fz_transform_rect(bounds, *ctm));
+	}
+	return 1;
+}
+
+// new_white_pixmap creates a pixmap cleared to white, taking its samples from the pixmap pool when possible. The
+// samples must be given back to the pool with pixmap_pool_release after the pixmap is dropped.
+static fz_pixmap *new_white_pixmap(fz_context *ctx, fz_colorspace *colorspace, fz_irect bbox, int alpha, unsigned char **samples, size_t *samples_size) {
+	fz_pixmap *pixmap;
+	size_t width = bbox.x1 > bbox.x0 ? (size_t)(bbox.x1 - bbox.x0) : 0;
+	size_t height = bbox.y1 > bbox.y0 ? (size_t)(bbox.y1 - bbox.y0) : 0;
+	size_t n = fz_colorspace_n(ctx, colorspace) + alpha;
+	if (width != 0 && height <= SIZE_MAX / n / width) {
+		*samples = pixmap_pool_acquire(ctx, width * height * n, samples_size);
+	}
+	if (*samples != NULL) {
+		pixmap = fz_new_pixmap_with_bbox_and_data(ctx, colorspace, bbox, NULL, alpha, *samples);
+	} else {
+		pixmap = fz_new_pixmap_with_bbox(ctx, colorspace, bbox, NULL, alpha);
+	}
+	fz_clear_pixmap_with_value(ctx, pixmap, 0xff);
+	return pixmap;
+}
+
+// encode_pixmap encodes the pixmap and copies the result to memory owned by the caller.
+static void encode_pixmap(fz_context *ctx, fz_pixmap *pixmap, int format, int quality, char **payload, size_t *payload_length) {
+	fz_buffer *buffer = NULL;
 	fz_var(buffer);
 
 	fz_try(ctx) {
-		stream = fz_open_memory(ctx, (const unsigned char *)input.payload, input.payload_length);
-		doc = pdf_open_document_with_stream(ctx, stream);
-		page = pdf_load_page(ctx, doc, input.page);
-
-		float scale_factor = 1.5;
-		fz_rect bounds = pdf_bound_page(ctx, page, FZ_CROP_BOX);
-		if (input.width != 0) {
-			scale_factor = input.width / bounds.x1;
-		} else if (input.scale != 0) {
-			scale_factor = input.scale;
-		} else if ((bounds.x1 - bounds.x0) > (bounds.y1 - bounds.y0)) {
-			switch (get_rotation(ctx, page)) {
-				case 0:
-				case 180:
-					scale_factor = 1;
-					break;
-				default:
-					scale_factor = 1.5;
+		switch (format) {
+			case FORMAT_JPEG:
+				buffer = fz_new_buffer_from_pixmap_as_jpeg(ctx, pixmap, fz_default_color_params, quality, 0);
+				break;
+			default:
+				buffer = fz_new_buffer_from_pixmap_as_png(ctx, pixmap, fz_default_color_params);
+		}
+		*payload_length = fz_buffer_storage(ctx, buffer, NULL);
+		*payload = je_malloc(sizeof(char)*(*payload_length));
+		if (*payload == NULL) {
+			fz_throw(ctx, FZ_ERROR_SYSTEM, "cannot allocate %zu bytes for the output", *payload_length);
+		}
+		memcpy(*payload, fz_string_from_buffer(ctx, buffer), *payload_length);
+	} fz_always(ctx) {
+		fz_drop_buffer(ctx, buffer);
+	} fz_catch(ctx) {
+		fz_rethrow(ctx);
+	}
+}
+
+// A PNG stream encodes a page as its rows are produced, for the renders that never hold the whole page in memory. The
+// output is byte for byte what fz_new_buffer_from_pixmap_as_png writes for the same pixels: the rows are unfiltered,
+// deflated at the default level and stored as a single IDAT chunk, which MuPDF writes when the pixmap is encoded in one
+// band. The pixmaps are opaque, so the samples need no unpremultiplying.
+typedef struct {
+	fz_buffer *idat;
+	fz_output *buffer;
+	fz_output *deflate;
+} png_stream;
+
+static uint32_t png_crc_table[256];
+static pthread_once_t png_crc_once = PTHREAD_ONCE_INIT;
+
+static void init_png_crc() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++) {
+			c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+		}
+		png_crc_table[i] = c;
+	}
+}
+
+static uint32_t png_crc(uint32_t crc, const unsigned char *data, size_t length) {
+	crc ^= 0xffffffffu;
+	for (size_t i = 0; i < length; i++) {
+		crc = png_crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffffu;
+}
+
+static unsigned char *png_put32(unsigned char *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+	return p + 4;
+}
+
+static unsigned char *png_chunk(unsigned char *p, const char *type, const unsigned char *data, size_t length) {
+	p = png_put32(p, length);
+	memcpy(p, type, 4);
+	if (length > 0) {
+		memcpy(p + 4, data, length);
+	}
+	return png_put32(p + 4 + length, png_crc(png_crc(0, p, 4), data, length));
+}
+
+static void png_stream_open(fz_context *ctx, png_stream *stream) {
+	pthread_once(&png_crc_once, init_png_crc);
+	stream->idat = fz_new_buffer(ctx, 64 * 1024);
+	stream->buffer = fz_new_output_with_buffer(ctx, stream->idat);
+	stream->deflate = fz_new_deflate_output(ctx, stream->buffer, FZ_DEFLATE_DEFAULT, 0);
+}
+
+static void png_stream_rows(fz_context *ctx, png_stream *stream, unsigned char *row, ptrdiff_t stride, int width, int height, int n) {
+	static const unsigned char no_filter = 0;
+	for (int y = 0; y < height; y++, row += stride) {
+		fz_write_data(ctx, stream->deflate, &no_filter, 1);
+		fz_write_data(ctx, stream->deflate, row, (size_t)width * n);
+	}
+}
+
+// png_stream_close finishes the image and copies it to memory owned by the caller.
+static void png_stream_close(fz_context *ctx, png_stream *stream, fz_pixmap *band, int height, char **payload, size_t *payload_length) {
+	fz_close_output(ctx, stream->deflate);
+	fz_close_output(ctx, stream->buffer);
+
+	int width = fz_pixmap_width(ctx, band);
+	int alpha = fz_pixmap_alpha(ctx, band);
+	int colorants = fz_pixmap_components(ctx, band) - alpha;
+	int xres = band->xres;
+	int yres = band->yres;
+	unsigned char ihdr[13] = {0};
+	png_put32(png_put32(ihdr, width), height);
+	ihdr[8] = 8;
+	ihdr[9] = (colorants == 3 ? 2 : 0) | (alpha ? 4 : 0);
+	unsigned char phys[9];
+	png_put32(png_put32(phys, (uint32_t)(xres / 0.0254f + 0.5f)), (uint32_t)(yres / 0.0254f + 0.5f));
+	phys[8] = 1;
+
+	unsigned char *idat;
+	size_t idat_length = fz_buffer_storage(ctx, stream->idat, &idat);
+	*payload_length = 8 + (12 + sizeof(ihdr)) + (12 + sizeof(phys)) + (12 + idat_length) + 12;
+	*payload = je_malloc(*payload_length);
+	if (*payload == NULL) {
+		fz_throw(ctx, FZ_ERROR_SYSTEM, "cannot allocate %zu bytes for the output", *payload_length);
+	}
+	unsigned char *p = (unsigned char *) *payload;
+	memcpy(p, "\x89PNG\r\n\x1a\n", 8);
+	p = png_chunk(p + 8, "IHDR", ihdr, sizeof(ihdr));
+	p = png_chunk(p, "pHYs", phys, sizeof(phys));
+	p = png_chunk(p, "IDAT", idat, idat_length);
+	png_chunk(p, "IEND", NULL, 0);
+}
+
+static void png_stream_drop(fz_context *ctx, png_stream *stream) {
+	fz_drop_output(ctx, stream->deflate);
+	fz_drop_output(ctx, stream->buffer);
+	fz_drop_buffer(ctx, stream->idat);
+}
+
+// A pixel has ink when any of its color components is darker than this level, so the noise of a scanned sheet of paper
+// doesn't count.
+#define INK_LEVEL 0xe0
+
+// rows_ink counts the pixels with ink in rows of samples.
+static size_t rows_ink(unsigned char *row, ptrdiff_t stride, int width, int height, int n, int colorants) {
+	size_t ink = 0;
+	for (int y = 0; y < height; y++, row += stride) {
+		unsigned char *pixel = row;
+		for (int x = 0; x < width; x++, pixel += n) {
+			for (int c = 0; c < colorants; c++) {
+				if (pixel[c] < INK_LEVEL) {
+					ink++;
+					break;
+				}
+			}
+		}
+	}
+	return ink;
+}
+
+// pixmap_ink returns the fraction of the pixels of the pixmap, from 0 to 1, that have ink.
+static float pixmap_ink(fz_context *ctx, fz_pixmap *pixmap) {
+	int width = fz_pixmap_width(ctx, pixmap);
+	int height = fz_pixmap_height(ctx, pixmap);
+	int n = fz_pixmap_components(ctx, pixmap);
+	if (width <= 0 || height <= 0) {
+		return 0;
+	}
+
+	size_t ink = rows_ink(fz_pixmap_samples(ctx, pixmap), fz_pixmap_stride(ctx, pixmap), width, height, n, n - fz_pixmap_alpha(ctx, pixmap));
+	return (float)ink / ((float)width * (float)height);
+}
+
+// hash_pixmap is fz_md5_pixmap with the geometry of the pixmap hashed first, so pixmaps with the same samples but a
+// different shape, like a transposed page, don't collide. The streamed renders hash their bands with the same steps.
+static void hash_begin(fz_md5 *md5, int width, int height, int n) {
+	fz_md5_init(md5);
+	fz_md5_update_int64(md5, width);
+	fz_md5_update_int64(md5, height);
+	fz_md5_update_int64(md5, n);
+}
+
+static void hash_rows(fz_md5 *md5, unsigned char *row, ptrdiff_t stride, int width, int height, int n) {
+	for (int y = 0; y < height; y++, row += stride) {
+		fz_md5_update(md5, row, (size_t)width * n);
+	}
+}
+
+static void hash_pixmap(fz_context *ctx, fz_pixmap *pixmap, unsigned char digest[16]) {
+	int width = fz_pixmap_width(ctx, pixmap);
+	int height = fz_pixmap_height(ctx, pixmap);
+	int n = fz_pixmap_components(ctx, pixmap);
+	fz_md5 md5;
+
+	hash_begin(&md5, width, height, n);
+	hash_rows(&md5, fz_pixmap_samples(ctx, pixmap), fz_pixmap_stride(ctx, pixmap), width, height, n);
+	fz_md5_final(&md5, digest);
+}
+
+// run_parallel calls fn for every index from 0 to count - 1, spreading the calls over the threads of a pool shared by
+// every call, one thread per CPU, each with the context of its thread at the shard. Concurrent calls queue their tasks
+// at the pool, so they never run more threads than it has. A pool thread takes one call at a time from the queued task
+// with the fewest threads working on it, then with the fewest calls taken by the pool, so a small task queued behind a
+// large one still gets its share. The calling thread makes calls too until none is left. The function is responsible
+// for catching its own errors and must not call run_parallel itself.
+typedef void (parallel_fn)(fz_context *ctx, void *arg, int index);
+
+typedef struct parallel_task {
+	engine_shard *shard;
+	parallel_fn *fn;
+	void *arg;
+	int count;
+	int next;
+	// Trace of the render the calls are made for, if any.
+	render_trace *trace;
+	// Pool threads making a call of the task, calls they took and whether it is still queued. All are guarded by the
+	// pool mutex.
+	int workers;
+	int taken;
+	int queued;
+	struct parallel_task *queue_next;
+} parallel_task;
+
+static struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t queued;
+	pthread_cond_t idle;
+	parallel_task *head;
+	parallel_task *tail;
+	long threads;
+} parallel_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.idle = PTHREAD_COND_INITIALIZER,
+};
+static pthread_once_t parallel_pool_once = PTHREAD_ONCE_INIT;
+
+// Must be called with the pool mutex held.
+static void dequeue_parallel_task(parallel_task *task) {
+	if (!task->queued) {
+		return;
+	}
+	parallel_task **link = &parallel_pool.head;
+	parallel_task *previous = NULL;
+	while (*link != task) {
+		previous = *link;
+		link = &(*link)->queue_next;
+	}
+	*link = task->queue_next;
+	if (parallel_pool.tail == task) {
+		parallel_pool.tail = previous;
+	}
+	task->queue_next = NULL;
+	task->queued = 0;
+}
+
+// Must be called with the pool mutex held.
+static parallel_task *pick_parallel_task() {
+	parallel_task *picked = parallel_pool.head;
+	for (parallel_task *task = parallel_pool.head; task != NULL; task = task->queue_next) {
+		if (task->workers < picked->workers || (task->workers == picked->workers && task->taken < picked->taken)) {
+			picked = task;
+		}
+	}
+	return picked;
+}
+
+static void run_parallel_calls(fz_context *ctx, parallel_task *task) {
+	for (;;) {
+		int index = __atomic_fetch_add(&task->next, 1, __ATOMIC_RELAXED);
+		if (index >= task->count) {
+			return;
+		}
+		task->fn(ctx, task->arg, index);
+	}
+}
+
+static void *parallel_pool_thread(void *arg) {
+	bind_thread_arena();
+	pthread_mutex_lock(&parallel_pool.mutex);
+	for (;;) {
+		while (parallel_pool.head == NULL) {
+			pthread_cond_wait(&parallel_pool.queued, &parallel_pool.mutex);
+		}
+		parallel_task *task = pick_parallel_task();
+		task->workers++;
+		task->taken++;
+		pthread_mutex_unlock(&parallel_pool.mutex);
+
+		// Without a context the calls are left to the calling thread, which makes every call no pool thread takes.
+		int index = -1;
+		fz_context *ctx = acquire_context(task->shard);
+		if (ctx != NULL) {
+			index = __atomic_fetch_add(&task->next, 1, __ATOMIC_RELAXED);
+			if (index < task->count) {
+				thread_render_trace = task->trace;
+				task->fn(ctx, task->arg, index);
+				thread_render_trace = NULL;
 			}
+			release_context(task->shard, ctx);
+		}
+
+		pthread_mutex_lock(&parallel_pool.mutex);
+		if (ctx == NULL || index >= task->count - 1) {
+			dequeue_parallel_task(task);
 		}
+		if (--task->workers == 0) {
+			pthread_cond_broadcast(&parallel_pool.idle);
+		}
+	}
+	return NULL;
+}
 
-		float resolution = (float)(input.dpi) / 72;
-		fz_matrix ctm = fz_concat(fz_scale(resolution, resolution), fz_scale(scale_factor, scale_factor));
-		bounds = fz_transform_rect(bounds, ctm);
-		fz_irect bbox = fz_round_rect(bounds);
-		pixmap = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, 1);
-		fz_clear_pixmap_with_value(ctx, pixmap, 0xff);
-		device = fz_new_draw_device(ctx, ctm, pixmap);
+// parallel_queue_stats counts the tasks waiting at the pool and the calls no thread took yet.
+static void parallel_queue_stats(int *tasks, int *calls) {
+	*tasks = 0;
+	*calls = 0;
+	pthread_mutex_lock(&parallel_pool.mutex);
+	for (parallel_task *task = parallel_pool.head; task != NULL; task = task->queue_next) {
+		*tasks += 1;
+		*calls += fz_maxi(task->count - __atomic_load_n(&task->next, __ATOMIC_RELAXED), 0);
+	}
+	pthread_mutex_unlock(&parallel_pool.mutex);
+}
+
+static void start_parallel_pool() {
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	for (long i = 0; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, parallel_pool_thread, NULL) != 0) {
+			break;
+		}
+		pthread_detach(thread);
+		parallel_pool.threads++;
+	}
+}
+
+static void run_parallel(engine_shard *shard, fz_context *ctx, int count, parallel_fn *fn, void *arg) {
+	parallel_task task = {
+		.shard = shard,
+		.fn = fn,
+		.arg = arg,
+		.count = count,
+		.next = 0,
+		.trace = thread_render_trace,
+		.workers = 0,
+		.taken = 0,
+		.queued = 0,
+		.queue_next = NULL,
+	};
+	pthread_once(&parallel_pool_once, start_parallel_pool);
+
+	// A single call is left to the calling thread, as are all the calls when there is no pool.
+	int queue = parallel_pool.threads > 0 && count > 1;
+	if (queue) {
+		pthread_mutex_lock(&parallel_pool.mutex);
+		task.queued = 1;
+		if (parallel_pool.tail != NULL) {
+			parallel_pool.tail->queue_next = &task;
+		} else {
+			parallel_pool.head = &task;
+		}
+		parallel_pool.tail = &task;
+		pthread_cond_broadcast(&parallel_pool.queued);
+		pthread_mutex_unlock(&parallel_pool.mutex);
+	}
+
+	run_parallel_calls(ctx, &task);
+
+	if (queue) {
+		pthread_mutex_lock(&parallel_pool.mutex);
+		dequeue_parallel_task(&task);
+		while (task.workers > 0) {
+			pthread_cond_wait(&parallel_pool.idle, &parallel_pool.mutex);
+		}
+		pthread_mutex_unlock(&parallel_pool.mutex);
+	}
+}
+
+// A band job draws a display list into a pixmap in horizontal bands, one thread per band up to the number of CPUs. Each
+// band is drawn into a pixmap that shares the samples of the rows it covers in the destination, so the bands are
+// stitched in place.
+typedef struct {
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_pixmap *pixmap;
+	int band_height;
+	fz_cookie *parent;
+	fz_cookie *cookies;
+	int bands;
+	int failed;
+	char error[256];
+} band_job;
+
+static void render_band(fz_context *ctx, void *arg, int index) {
+	band_job *job = (band_job *) arg;
+	fz_cookie *cookie = &job->cookies[index];
+	fz_pixmap *band = NULL;
+	fz_device *device = NULL;
+
+	fz_var(band);
+	fz_var(device);
+
+	if (job->parent->abort) {
+		cookie->abort = 1;
+		return;
+	}
+	fz_try(ctx) {
+		fz_irect bbox = fz_pixmap_bbox(ctx, job->pixmap);
+		fz_irect band_bbox = bbox;
+		band_bbox.y0 = bbox.y0 + index * job->band_height;
+		band_bbox.y1 = fz_mini(band_bbox.y0 + job->band_height, bbox.y1);
+
+		unsigned char *samples = fz_pixmap_samples(ctx, job->pixmap) + (size_t)(band_bbox.y0 - bbox.y0) * fz_pixmap_stride(ctx, job->pixmap);
+		band = fz_new_pixmap_with_bbox_and_data(ctx, fz_pixmap_colorspace(ctx, job->pixmap), band_bbox, NULL, fz_pixmap_alpha(ctx, job->pixmap), samples);
+		device = fz_new_draw_device_with_bbox(ctx, fz_identity, band, &band_bbox);
 		fz_enable_device_hints(ctx, device, FZ_NO_CACHE);
-		pdf_run_page(ctx, page, device, fz_identity, input.cookie);
-		buffer = fz_new_buffer_from_pixmap_as_png(ctx, pixmap, fz_default_color_params);
-		output.payload_length = fz_buffer_storage(ctx, buffer, NULL);
-		output.payload = je_malloc(sizeof(char)*output.payload_length);
-		memcpy(output.payload, fz_string_from_buffer(ctx, buffer), output.payload_length);
+		fz_run_display_list(ctx, job->list, device, job->ctm, fz_rect_from_irect(band_bbox), cookie);
+		fz_close_device(ctx, device);
+	} fz_always(ctx) {
+		fz_drop_device(ctx, device);
+		fz_drop_pixmap(ctx, band);
+	} fz_catch(ctx) {
+		// An aborted band leaves the draw device unbalanced, closing it fails and that is not an error of the render.
+		if (!cookie->abort && __atomic_exchange_n(&job->failed, 1, __ATOMIC_ACQ_REL) == 0) {
+			fz_strlcpy(job->error, fz_caught_message(ctx), sizeof(job->error));
+		}
+	}
+}
+
+// render_bands draws the display list into the pixmap splitting the work in the given number of bands. Every band has
+// a cookie of its own. The caller passes them, one per band, when it must be able to abort the bands being drawn, else
+// they are allocated here and the abort flag of the render only stops the bands not started yet.
+static void render_bands(fz_context *ctx, engine_shard *shard, fz_display_list *list, fz_matrix ctm, fz_pixmap *pixmap,
+		int bands, fz_cookie *cookie, fz_cookie *band_cookies) {
+	int height = fz_pixmap_height(ctx, pixmap);
+	if (bands > height) {
+		bands = height;
+	}
+	if (bands < 1) {
+		bands = 1;
+	}
+
+	band_job job = {
+		.list = list,
+		.ctm = ctm,
+		.pixmap = pixmap,
+		.band_height = (height + bands - 1) / bands,
+		.parent = cookie,
+		.bands = bands,
+		.failed = 0,
+	};
+	job.cookies = band_cookies != NULL ? band_cookies : fz_calloc(ctx, bands, sizeof(fz_cookie));
+	run_parallel(shard, ctx, bands, render_band, &job);
+	for (int i = 0; i < bands; i++) {
+		cookie->errors += job.cookies[i].errors;
+	}
+	if (band_cookies == NULL) {
+		fz_free(ctx, job.cookies);
+	}
+
+	if (job.failed) {
+		fz_throw(ctx, FZ_ERROR_GENERIC, "%s", job.error);
+	}
+}
+
+// Renders whose pixmap would take more than the stream threshold are streamed: the page is drawn in bands into a single
+// band sized pixmap and every band is encoded as soon as it's drawn, so the memory of the render is bounded by the band
+// and the encoded output. The threshold defaults to 256 MiB and 0 disables streaming.
+#define STREAM_BAND_BYTES (16 * 1024 * 1024)
+// Bands are drawn with extra rows above and below that are thrown away, so what straddles the edge of a band is drawn
+// as in a render of the whole page. Vector content and text come out identical, but MuPDF decodes and resamples the
+// part of an image that is visible, an image that crosses a band may still differ by a few levels. The overlap counts
+// against the band bytes, a page so wide that they hold few rows gets at most a quarter of them above and below.
+#define STREAM_BAND_OVERLAP 128
+
+static size_t stream_threshold = 256 * 1024 * 1024;
+
+// stream_band_bytes returns the size of the bands, which is never above the threshold.
+static size_t stream_band_bytes() {
+	size_t threshold = __atomic_load_n(&stream_threshold, __ATOMIC_RELAXED);
+	return threshold < STREAM_BAND_BYTES ? threshold : STREAM_BAND_BYTES;
+}
+
+void set_stream_threshold(size_t threshold) {
+	__atomic_store_n(&stream_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+static int should_stream(fz_context *ctx, fz_irect bbox, fz_colorspace *colorspace, int alpha) {
+	size_t threshold = __atomic_load_n(&stream_threshold, __ATOMIC_RELAXED);
+	if (threshold == 0 || fz_is_empty_irect(bbox)) {
+		return 0;
+	}
+	uint64_t n = fz_colorspace_n(ctx, colorspace) + alpha;
+	return (uint64_t)(bbox.x1 - bbox.x0) * (uint64_t)(bbox.y1 - bbox.y0) * n > threshold;
+}
+
+// render_streamed draws and encodes the display list band by band, filling the output like the rest of save_to_png
+// does for a whole pixmap.
+static void render_streamed(fz_context *ctx, fz_display_list *list, fz_matrix ctm, fz_irect bbox, fz_colorspace *colorspace, int alpha, save_to_png_input *input, save_to_png_output *output) {
+	int width = bbox.x1 - bbox.x0;
+	int height = bbox.y1 - bbox.y0;
+	int n = fz_colorspace_n(ctx, colorspace) + alpha;
+	int rows = fz_maxi(1, stream_band_bytes() / ((size_t)width * n));
+	int overlap = fz_mini(STREAM_BAND_OVERLAP, rows / 4);
+	int band_height = fz_maxi(1, rows - 2 * overlap);
+	fz_pixmap *buffer = NULL;
+	fz_pixmap *band = NULL;
+	fz_device *device = NULL;
+	png_stream png = {0};
+	fz_md5 md5;
+	size_t ink = 0;
+	uint64_t encode = 0;
+
+	fz_var(buffer);
+	fz_var(band);
+	fz_var(device);
+	fz_var(png.idat);
+	fz_var(png.buffer);
+	fz_var(png.deflate);
+
+	fz_try(ctx) {
+		fz_irect buffer_bbox = {bbox.x0, 0, bbox.x1, band_height + 2 * overlap};
+		buffer = fz_new_pixmap_with_bbox(ctx, colorspace, buffer_bbox, NULL, alpha);
+		png_stream_open(ctx, &png);
+		hash_begin(&md5, width, height, n);
+
+		for (int y = bbox.y0; y < bbox.y1; y += band_height) {
+			fz_irect inner = {bbox.x0, y, bbox.x1, fz_mini(y + band_height, bbox.y1)};
+			fz_irect outer = {bbox.x0, fz_maxi(bbox.y0, y - overlap), bbox.x1, fz_mini(inner.y1 + overlap, bbox.y1)};
+			band = fz_new_pixmap_with_bbox_and_data(ctx, colorspace, outer, NULL, alpha, fz_pixmap_samples(ctx, buffer));
+			fz_clear_pixmap_with_value(ctx, band, 0xff);
+			// Once aborted the rest of the page is left white, like the pixmap of an aborted render.
+			if (!input->cookie->abort) {
+				device = fz_new_draw_device_with_bbox(ctx, fz_identity, band, &outer);
+				fz_enable_device_hints(ctx, device, FZ_NO_CACHE);
+				fz_run_display_list(ctx, list, device, ctm, fz_rect_from_irect(outer), input->cookie);
+				fz_close_device(ctx, device);
+				fz_drop_device(ctx, device);
+				device = NULL;
+			}
+			if (input->cookie->abort) {
+				output->aborted = 1;
+				if (!input->best_effort) {
+					fz_throw(ctx, FZ_ERROR_ABORT, "render aborted");
+				}
+			}
+
+			ptrdiff_t stride = fz_pixmap_stride(ctx, band);
+			unsigned char *rows = fz_pixmap_samples(ctx, band) + (size_t)(inner.y0 - outer.y0) * stride;
+			int count = inner.y1 - inner.y0;
+			if (input->skip_blank) {
+				ink += rows_ink(rows, stride, width, count, n, n - alpha);
+			}
+			if (input->hash_pixels) {
+				hash_rows(&md5, rows, stride, width, count, n);
+			}
+			uint64_t mark = now_ns();
+			png_stream_rows(ctx, &png, rows, stride, width, count, n);
+			encode += now_ns() - mark;
+			fz_drop_pixmap(ctx, band);
+			band = NULL;
+		}
+
+		if (input->skip_blank && (float)ink / ((float)width * (float)height) <= input->max_ink) {
+			output->blank = 1;
+		} else {
+			if (input->hash_pixels) {
+				fz_md5_final(&md5, output->pixel_hash);
+				output->deduplicated = input->pixel_lookup != 0 && lookupPixelHash(input->pixel_lookup, output->pixel_hash);
+			}
+			if (!output->deduplicated) {
+				uint64_t mark = now_ns();
+				png_stream_close(ctx, &png, buffer, height, &output->payload, &output->payload_length);
+				encode += now_ns() - mark;
+			}
+		}
+		output->timings.encode = encode;
+	} fz_always(ctx) {
+		fz_drop_device(ctx, device);
+		fz_drop_pixmap(ctx, band);
+		fz_drop_pixmap(ctx, buffer);
+		png_stream_drop(ctx, &png);
+	} fz_catch(ctx) {
+		fz_rethrow(ctx);
+	}
+}
+
+// Counts the warnings about objects MuPDF could not find, which it may carry on without instead of failing.
+static void count_missing_object(void *user, const char *message) {
+	if (strstr(message, "xref") != NULL || strstr(message, "cannot load object") != NULL) {
+		(*(int *) user)++;
+	}
+}
+
+// MuPDF carries on past the objects it could not read yet while running a page, it only marks the cookie incomplete.
+static void check_first_page_section(fz_context *ctx, int missing, fz_cookie *cookie) {
+	if (missing > 0 || cookie->incomplete) {
+		fz_throw(ctx, FZ_ERROR_TRYLATER, "the page needs objects outside of the first page section");
+	}
+}
+
+// render_page renders the page into output. When linear is set and the payload is linearized only its first page
+// section is read: the reader stream stops there and is marked progressive, so MuPDF loads the linearization
+// dictionary and the first page xref alone and takes the page straight from the dictionary. Anything the page needs
+// from outside of the section fails with a try later error, or shows up as a warning about the missing object or an
+// incomplete cookie, which are checked right after the page is loaded and run. In that case render_page returns 0
+// before anything is encoded and the render must be done again the regular way.
+static int render_page(fz_context *ctx, engine_shard *shard, save_to_png_input *input, int linear, save_to_png_output *output) {
+	int missing = 0;
+	int progressive = 0;
+	int retry = 0;
+
+	fz_stream *stream = NULL;
+	pdf_document *doc = NULL;
+	pdf_page *page = NULL;
+	fz_display_list *list = NULL;
+	fz_device *device = NULL;
+	fz_device *test = NULL;
+	fz_pixmap *pixmap = NULL;
+	unsigned char *samples = NULL;
+	size_t samples_size = 0;
+
+	fz_var(progressive);
+	fz_var(stream);
+	fz_var(doc);
+	fz_var(page);
+	fz_var(list);
+	fz_var(device);
+	fz_var(test);
+	fz_var(pixmap);
+	fz_var(samples);
+	fz_var(samples_size);
+
+	fz_try(ctx) {
+		uint64_t mark = now_ns();
+		stream = open_payload(ctx, input->payload, input->payload_length, input->payload_reader);
+		// MuPDF looks a byte past the last object of the section, the limit is the end of the block holding it, which
+		// is fetched as a whole anyway. There is nothing to save when that block is the end of the payload.
+		int64_t end = linear ? first_page_end(ctx, stream) : 0;
+		int64_t limit = end - end % READER_BLOCK_SIZE + READER_BLOCK_SIZE;
+		if (end > 0 && limit < (int64_t) input->payload_length) {
+			((reader_state *) stream->state)->limit = limit;
+			stream->progressive = 1;
+			progressive = 1;
+			fz_flush_warnings(ctx);
+			fz_set_warning_callback(ctx, count_missing_object, &missing);
+		}
+		doc = pdf_open_document_with_stream(ctx, stream);
+		// A document MuPDF can't read linearly needs the xref at the end of the payload, opening it failed already.
+		output->linear = progressive;
+		output->timings.open = now_ns() - mark;
+
+		mark = now_ns();
+		page = pdf_load_page(ctx, doc, input->page);
+		check_first_page_section(ctx, missing, input->cookie);
+		output->timings.load = now_ns() - mark;
+
+		fz_rect bounds = pdf_bound_page(ctx, page, FZ_CROP_BOX);
+		float scale_factor = input->fit_width > 0 || input->fit_height > 0
+			? fit_scale_factor(bounds, input->fit_width, input->fit_height, input->dpi)
+			: page_scale_factor(ctx, page, bounds, input->width, input->scale);
+		fz_matrix ctm = page_ctm(scale_factor, input->dpi);
+		fz_irect bbox = fz_round_rect(fz_transform_rect(bounds, ctm));
+		output->clamped = clamp_ctm(bounds, input->max_pixels, &ctm, &bbox);
+		// Gray pages have no use for an alpha channel, the pixmap is opaque anyway.
+		fz_colorspace *colorspace = fz_device_rgb(ctx);
+		int alpha = 1;
+		if (input->colorspace == COLORSPACE_GRAY) {
+			colorspace = fz_device_gray(ctx);
+			alpha = 0;
+		}
+		mark = now_ns();
+		// A page that may be streamed is recorded first, whether it is depends on the colorspace of an auto render.
+		int streamed = should_stream(ctx, bbox, colorspace, alpha);
+		if (input->bands > 1 || input->colorspace == COLORSPACE_AUTO || streamed) {
+			// The page is recorded once and then drawn, after the colorspace is known and by many threads when it's
+			// split in bands.
+			list = fz_new_display_list(ctx, bounds);
+			device = fz_new_list_device(ctx, list);
+			if (input->colorspace == COLORSPACE_AUTO) {
+				// The test device looks for color while passing everything through to the list.
+				int is_color = 0;
+				test = fz_new_test_device(ctx, &is_color, 0.02f, FZ_TEST_OPT_IMAGES | FZ_TEST_OPT_SHADINGS, device);
+				pdf_run_page(ctx, page, test, fz_identity, input->cookie);
+				fz_close_device(ctx, test);
+				if (!is_color) {
+					colorspace = fz_device_gray(ctx);
+					alpha = 0;
+				}
+			} else {
+				pdf_run_page(ctx, page, device, fz_identity, input->cookie);
+			}
+			fz_close_device(ctx, device);
+			fz_drop_device(ctx, device);
+			device = NULL;
+			check_first_page_section(ctx, missing, input->cookie);
+
+			streamed = should_stream(ctx, bbox, colorspace, alpha);
+			if (streamed) {
+				render_streamed(ctx, list, ctm, bbox, colorspace, alpha, input, output);
+			} else {
+				pixmap = new_white_pixmap(ctx, colorspace, bbox, alpha, &samples, &samples_size);
+				if (input->bands > 1) {
+					render_bands(ctx, shard, list, ctm, pixmap, input->bands, input->cookie, input->band_cookies);
+				} else {
+					device = fz_new_draw_device(ctx, ctm, pixmap);
+					fz_enable_device_hints(ctx, device, FZ_NO_CACHE);
+					fz_run_display_list(ctx, list, device, fz_identity, fz_infinite_rect, input->cookie);
+				}
+			}
+		} else {
+			pixmap = new_white_pixmap(ctx, colorspace, bbox, alpha, &samples, &samples_size);
+			device = fz_new_draw_device(ctx, ctm, pixmap);
+			fz_enable_device_hints(ctx, device, FZ_NO_CACHE);
+			pdf_run_page(ctx, page, device, fz_identity, input->cookie);
+			check_first_page_section(ctx, missing, input->cookie);
+		}
+		output->gray = colorspace == fz_device_gray(ctx);
+		output->streamed = streamed;
+		output->glyph_cache = glyph_cache_size(shard);
+		output->timings.run = now_ns() - mark - output->timings.encode;
+
+		// MuPDF stops the interpretation quietly when the cookie is aborted, what is left at the pixmap is only part of
+		// the page. It's only encoded when the caller asked for a best effort render. Streamed renders were already
+		// encoded.
+		if (!streamed) {
+			if (input->cookie->abort) {
+				output->aborted = 1;
+				if (!input->best_effort) {
+					fz_throw(ctx, FZ_ERROR_ABORT, "render aborted");
+				}
+			}
+			if (input->skip_blank && pixmap_ink(ctx, pixmap) <= input->max_ink) {
+				output->blank = 1;
+			} else {
+				if (input->hash_pixels) {
+					hash_pixmap(ctx, pixmap, output->pixel_hash);
+					// Go knows the outputs rendered so far, when one has the same pixels it's reused as is.
+					output->deduplicated = input->pixel_lookup != 0 && lookupPixelHash(input->pixel_lookup, output->pixel_hash);
+				}
+				if (!output->deduplicated) {
+					mark = now_ns();
+					encode_pixmap(ctx, pixmap, FORMAT_PNG, 0, &output->payload, &output->payload_length);
+					output->timings.encode = now_ns() - mark;
+				}
+			}
+		}
 	} fz_always(ctx) {
-		fz_drop_buffer(ctx, buffer);
 		fz_try(ctx) {
 			fz_close_device(ctx, device);
 		} fz_catch(ctx) {}
+		fz_drop_device(ctx, test);
+		fz_drop_device(ctx, device);
+		fz_drop_display_list(ctx, list);
+		fz_drop_pixmap(ctx, pixmap);
+		pixmap_pool_release(samples, samples_size);
+		fz_drop_page(ctx, (fz_page*)page);
+		pdf_drop_document(ctx, doc);
+		fz_drop_stream(ctx, stream);
+		if (progressive) {
+			fz_flush_warnings(ctx);
+			fz_set_warning_callback(ctx, NULL, NULL);
+		}
+	} fz_catch(ctx) {
+		if (progressive && fz_caught(ctx) == FZ_ERROR_TRYLATER && !input->cookie->abort) {
+			fz_ignore_error(ctx);
+			retry = 1;
+		} else {
+			output->error = strdup(fz_caught_message(ctx));
+		}
+	}
+
+	return !retry;
+}
+
+static void reset_render_output(save_to_png_output *output) {
+	output->payload = NULL;
+	output->payload_length = 0;
+	output->aborted = 0;
+	output->blank = 0;
+	output->gray = 0;
+	output->deduplicated = 0;
+	output->clamped = 0;
+	output->streamed = 0;
+	output->linear = 0;
+	output->glyph_cache = 0;
+	output->timings = (phase_timings){0};
+	output->error = NULL;
+}
+
+save_to_png_output save_to_png(save_to_png_input input) {
+	save_to_png_output output;
+	reset_render_output(&output);
+
+	bind_thread_arena();
+	__atomic_add_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+	render_trace trace;
+	trace_render_start(&trace, &output.memory);
+	engine_shard *shard = pick_shard(input.shard_key);
+	fz_context *ctx = acquire_context(shard);
+	if (ctx == NULL) {
+		trace_render_stop();
+		__atomic_sub_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+		output.error = strdup("fail to create a context");
+		return output;
+	}
+
+	// The first page of a payload read through Go is tried from the first page section when it is linearized, what was
+	// loaded is thrown away when that was not enough.
+	int errors = input.cookie->errors;
+	int incomplete = input.cookie->incomplete;
+	if (!render_page(ctx, shard, &input, input.page == 0 && input.payload_reader != 0, &output)) {
+		reset_render_output(&output);
+		input.cookie->errors = errors;
+		input.cookie->incomplete = incomplete;
+		render_page(ctx, shard, &input, 0, &output);
+	}
+	release_context(shard, ctx);
+	trace_render_stop();
+	__atomic_sub_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+
+	return output;
+}
+
+page_content_output page_content(page_content_input input) {
+	page_content_output output;
+	output.content = fz_empty_rect;
+	output.ink = 0;
+	output.aborted = 0;
+	output.error = NULL;
+
+	bind_thread_arena();
+	__atomic_add_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+	engine_shard *shard = pick_shard(0);
+	fz_context *ctx = acquire_context(shard);
+	if (ctx == NULL) {
+		__atomic_sub_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+		output.error = strdup("fail to create a context");
+		return output;
+	}
+
+	fz_stream *stream = NULL;
+	pdf_document *doc = NULL;
+	pdf_page *page = NULL;
+	fz_device *device = NULL;
+	fz_pixmap *pixmap = NULL;
+	unsigned char *samples = NULL;
+	size_t samples_size = 0;
+
+	fz_var(stream);
+	fz_var(doc);
+	fz_var(page);
+	fz_var(device);
+	fz_var(pixmap);
+	fz_var(samples);
+	fz_var(samples_size);
+
+	fz_try(ctx) {
+		stream = fz_open_memory(ctx, (const unsigned char *)input.payload, input.payload_length);
+		doc = pdf_open_document_with_stream(ctx, stream);
+		page = pdf_load_page(ctx, doc, input.page);
+		fz_rect bounds = pdf_bound_page(ctx, page, FZ_CROP_BOX);
+
+		// The bbox device only accumulates the area touched by each drawing operation, nothing is rasterized.
+		fz_rect content = fz_empty_rect;
+		device = fz_new_bbox_device(ctx, &content);
+		pdf_run_page(ctx, page, device, fz_identity, input.cookie);
+		fz_close_device(ctx, device);
+		fz_drop_device(ctx, device);
+		device = NULL;
+		output.content = fz_intersect_rect(content, bounds);
+
+		// Anything drawn, even a white image, has a bounding box. The ink check renders the page in gray at a low
+		// resolution to find out if any of it is actually visible.
+		if (input.ink_dpi > 0 && !fz_is_empty_rect(output.content) && !input.cookie->abort) {
+			fz_matrix ctm = page_ctm(1, input.ink_dpi);
+			fz_irect bbox = fz_round_rect(fz_transform_rect(bounds, ctm));
+			pixmap = new_white_pixmap(ctx, fz_device_gray(ctx), bbox, 0, &samples, &samples_size);
+			device = fz_new_draw_device(ctx, ctm, pixmap);
+			fz_enable_device_hints(ctx, device, FZ_NO_CACHE);
+			pdf_run_page(ctx, page, device, fz_identity, input.cookie);
+			fz_close_device(ctx, device);
+			output.ink = pixmap_ink(ctx, pixmap);
+		}
+		if (input.cookie->abort) {
+			output.aborted = 1;
+			fz_throw(ctx, FZ_ERROR_ABORT, "render aborted");
+		}
+	} fz_always(ctx) {
 		fz_drop_device(ctx, device);
 		fz_drop_pixmap(ctx, pixmap);
+		pixmap_pool_release(samples, samples_size);
 		fz_drop_page(ctx, (fz_page*)page);
 		pdf_drop_document(ctx, doc);
 		fz_drop_stream(ctx, stream);
 	} fz_catch(ctx) {
 		output.error = strdup(fz_caught_message(ctx));
 	}
-	fz_drop_context(ctx);
+	release_context(shard, ctx);
+	__atomic_sub_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+
+	return output;
+}
+
+// A rendition job renders many sizes of a page from a single display list, so the page is interpreted only once. The
+// renditions are drawn in parallel.
+typedef struct {
+	render_renditions_input *input;
+	render_renditions_output *output;
+	fz_display_list *list;
+	fz_matrix *ctms;
+	fz_irect *bboxes;
+} rendition_job;
+
+static void render_rendition(fz_context *ctx, void *arg, int index) {
+	rendition_job *job = (rendition_job *) arg;
+	rendition_spec spec = job->input->specs[index];
+	rendition_output *output = &job->output->outputs[index];
+	fz_cookie *cookie = &job->input->cookies[index + 1];
+	fz_device *device = NULL;
+	fz_pixmap *pixmap = NULL;
+	unsigned char *samples = NULL;
+	size_t samples_size = 0;
+
+	fz_var(device);
+	fz_var(pixmap);
+	fz_var(samples);
+	fz_var(samples_size);
+
+	fz_try(ctx) {
+		// JPEG has no alpha channel.
+		int alpha = spec.format == FORMAT_PNG;
+		pixmap = new_white_pixmap(ctx, fz_device_rgb(ctx), job->bboxes[index], alpha, &samples, &samples_size);
+		device = fz_new_draw_device(ctx, fz_identity, pixmap);
+		fz_enable_device_hints(ctx, device, FZ_NO_CACHE);
+		fz_run_display_list(ctx, job->list, device, job->ctms[index], fz_infinite_rect, cookie);
+		fz_close_device(ctx, device);
+		if (cookie->abort) {
+			fz_throw(ctx, FZ_ERROR_ABORT, "render aborted");
+		}
+		encode_pixmap(ctx, pixmap, spec.format, spec.quality, &output->payload, &output->payload_length);
+	} fz_always(ctx) {
+		fz_drop_device(ctx, device);
+		fz_drop_pixmap(ctx, pixmap);
+		pixmap_pool_release(samples, samples_size);
+	} fz_catch(ctx) {
+		output->error = strdup(fz_caught_message(ctx));
+	}
+}
+
+render_renditions_output render_renditions(render_renditions_input input) {
+	render_renditions_output output;
+	output.outputs = je_calloc(input.specs_length > 0 ? input.specs_length : 1, sizeof(rendition_output));
+	output.aborted = 0;
+	output.error = NULL;
+	if (output.outputs == NULL) {
+		output.error = strdup("fail to allocate the outputs");
+		return output;
+	}
+
+	bind_thread_arena();
+	__atomic_add_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+	engine_shard *shard = pick_shard(0);
+	fz_context *ctx = acquire_context(shard);
+	if (ctx == NULL) {
+		__atomic_sub_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+		output.error = strdup("fail to create a context");
+		return output;
+	}
+
+	fz_stream *stream = NULL;
+	pdf_document *doc = NULL;
+	pdf_page *page = NULL;
+	fz_display_list *list = NULL;
+	fz_device *device = NULL;
+	rendition_job job = {.input = &input, .output = &output};
+
+	fz_var(stream);
+	fz_var(doc);
+	fz_var(page);
+	fz_var(list);
+	fz_var(device);
+	fz_var(job.ctms);
+	fz_var(job.bboxes);
+
+	fz_try(ctx) {
+		stream = fz_open_memory(ctx, (const unsigned char *)input.payload, input.payload_length);
+		doc = pdf_open_document_with_stream(ctx, stream);
+		page = pdf_load_page(ctx, doc, input.page);
+
+		fz_rect bounds = pdf_bound_page(ctx, page, FZ_CROP_BOX);
+		list = fz_new_display_list(ctx, bounds);
+		device = fz_new_list_device(ctx, list);
+		pdf_run_page(ctx, page, device, fz_identity, &input.cookies[0]);
+		fz_close_device(ctx, device);
+		if (input.cookies[0].abort) {
+			fz_throw(ctx, FZ_ERROR_ABORT, "render aborted");
+		}
+
+		// The page is only touched by this thread, everything the workers need from it is computed upfront.
+		job.list = list;
+		job.ctms = fz_calloc(ctx, input.specs_length, sizeof(fz_matrix));
+		job.bboxes = fz_calloc(ctx, input.specs_length, sizeof(fz_irect));
+		for (int i = 0; i < input.specs_length; i++) {
+			rendition_spec spec = input.specs[i];
+			job.ctms[i] = page_ctm(page_scale_factor(ctx, page, bounds, spec.width, spec.scale), spec.dpi);
+			job.bboxes[i] = fz_round_rect(fz_transform_rect(bounds, job.ctms[i]));
+			clamp_ctm(bounds, spec.max_pixels, &job.ctms[i], &job.bboxes[i]);
+		}
+		run_parallel(shard, ctx, input.specs_length, render_rendition, &job);
+
+		for (int i = 0; i < input.specs_length; i++) {
+			if (input.cookies[i + 1].abort) {
+				fz_throw(ctx, FZ_ERROR_ABORT, "render aborted");
+			}
+		}
+	} fz_always(ctx) {
+		fz_free(ctx, job.ctms);
+		fz_free(ctx, job.bboxes);
+		fz_drop_device(ctx, device);
+		fz_drop_display_list(ctx, list);
+		fz_drop_page(ctx, (fz_page*)page);
+		pdf_drop_document(ctx, doc);
+		fz_drop_stream(ctx, stream);
+	} fz_catch(ctx) {
+		if (fz_caught(ctx) == FZ_ERROR_ABORT) {
+			output.aborted = 1;
+		}
+		output.error = strdup(fz_caught_message(ctx));
+	}
+	release_context(shard, ctx);
+	__atomic_sub_fetch(&active_renders, 1, __ATOMIC_RELAXED);
+
+	return output;
+}
+
+// The documents of a batch are counted by the run_parallel workers, each with the context of its thread.
+static void count_batch_document(fz_context *ctx, void *arg, int index) {
+	page_counts_input *input = arg;
+	page_count_output *output = &input->outputs[index];
+	output->count = 0;
+	output->timings = (phase_timings){0};
+	output->error = NULL;
+	if (input->cookie->abort) {
+		output->error = strdup("aborted");
+		return;
+	}
+
+	__atomic_add_fetch(&active_page_counts, 1, __ATOMIC_RELAXED);
+	count_pages(ctx, input->inputs[index], output);
+	__atomic_sub_fetch(&active_page_counts, 1, __ATOMIC_RELAXED);
+}
+
+page_counts_output page_counts(page_counts_input input) {
+	page_counts_output output;
+	output.error = NULL;
+
+	bind_thread_arena();
+	engine_shard *shard = pick_shard(0);
+	fz_context *ctx = acquire_context(shard);
+	if (ctx == NULL) {
+		output.error = strdup("fail to create a context");
+		return output;
+	}
+
+	fz_try(ctx) {
+		run_parallel(shard, ctx, input.length, count_batch_document, &input);
+	} fz_catch(ctx) {
+		output.error = strdup(fz_caught_message(ctx));
+	}
+	release_context(shard, ctx);
 
 	return output;
 }
@@ -11,15 +11,22 @@ import "C"
 
 import (
 	"context"
+	"encoding/hex"
 	"errors"
 	"fmt"
 	"io"
+	"runtime"
+	"runtime/cgo"
+	"time"
 	"unsafe"
 
 	ddTracer "gopkg.in/DataDog/dd-trace-go.v1/ddtrace/tracer"
 )
 
-const defaultDPI = 72
+const (
+	defaultDPI              = 72
+	defaultProgressInterval = 100 * time.Millisecond
+)
 
 func init() {
 	C.init()
@@ -32,11 +39,26 @@ func init() {
 // factor of 1.
 // If width is set then we'll calculate the scale factor by dividing the width by the page horizontal size.
 // If both width and scale are set we'll use only the scale as it takes precedence.
+// The render can be further customized with options, check the RenderOption functions for more information.
 func SaveToPNG(
-	ctx context.Context, page, width uint16, scale float32, dpi int, rawPayload io.Reader, output io.Writer,
+	ctx context.Context,
+	page, width uint16,
+	scale float32,
+	dpi int,
+	rawPayload io.Reader,
+	output io.Writer,
+	opts ...RenderOption,
 ) (err error) {
 	span, _ := ddTracer.StartSpanFromContext(ctx, "lazypdf.SaveToPNG")
-	defer func() { span.Finish(ddTracer.WithError(err)) }()
+	options := newRenderOptions(opts)
+	var stats RenderStats
+	defer func() {
+		stats.tag(span)
+		if options.stats != nil {
+			*options.stats = stats
+		}
+		span.Finish(ddTracer.WithError(err))
+	}()
 
 	if rawPayload == nil {
 		return errors.New("payload can't be nil")
@@ -45,40 +67,267 @@ func SaveToPNG(
 		return errors.New("output can't be nil")
 	}
 
-	payload, err := io.ReadAll(rawPayload)
+	// The payload is hashed whole, it can't be read by ranges when it's needed.
+	hashed := options.hash || options.cache != nil
+	mark := time.Now()
+	payload, err := readPayload(rawPayload, !hashed)
+	if err != nil {
+		return err
+	}
+	stats.Read = time.Since(mark)
+
+	var result []byte
+	if hashed {
+		stats.DocumentHash = payloadHash(payload.data)
+	}
+	if options.cache != nil {
+		key := cacheKey(stats.DocumentHash, page, width, scale, max(dpi, defaultDPI), options)
+		result, stats.Cached, err = options.cache.do(ctx, key, func() ([]byte, bool, error) {
+			result, err := saveToPNG(ctx, page, width, scale, dpi, payload, options, &stats)
+			if err == nil && !stats.Incomplete {
+				options.cache.index(key, stats.PixelHash)
+			}
+			return result, stats.Incomplete, err
+		})
+		if err == nil && stats.Cached {
+			stats.PixelHash = options.cache.pixelHash(key)
+		}
+	} else {
+		result, err = saveToPNG(ctx, page, width, scale, dpi, payload, options, &stats)
+	}
 	if err != nil {
-		return fmt.Errorf("fail to read the payload: %w", err)
+		return err
+	}
+
+	mark = time.Now()
+	if _, err := output.Write(result); err != nil {
+		return fmt.Errorf("fail to write to the output: %w", err)
 	}
+	stats.Write = time.Since(mark)
+	return nil
+}
 
+// saveToPNG renders the page at the C layer.
+func saveToPNG(
+	ctx context.Context,
+	page, width uint16,
+	scale float32,
+	dpi int,
+	payload *payloadSource,
+	options renderOptions,
+	stats *RenderStats,
+) ([]byte, error) {
 	input := C.save_to_png_input{
-		page:           C.int(page),
-		width:          C.int(width),
-		scale:          C.float(scale),
-		dpi:            C.int(dpi),
-		payload:        (*C.char)(unsafe.Pointer(&payload[0])),
-		payload_length: C.size_t(len(payload)),
-		cookie:         &C.fz_cookie{abort: 0},
+		page:  C.int(page),
+		width: C.int(width),
+		scale: C.float(scale),
+		dpi:   C.int(dpi),
+		// The renders of a hashed document stay at the same shard.
+		shard_key: C.uint64_t(shardKey(stats.DocumentHash)),
 	}
+	var release func()
+	input.payload, input.payload_length, input.payload_reader, release = payload.bind()
+	defer release()
 	if dpi < defaultDPI {
 		input.dpi = C.int(defaultDPI)
 	}
-	go func() {
-		<-ctx.Done()
-		input.cookie.abort = 1
-	}()
+	if options.bestEffort {
+		input.best_effort = 1
+	}
+	// The render has a cookie and a banded render one more per band. They live in C memory as the worker threads write
+	// them while Go flips the abort flag.
+	cookiesLength := 1
+	if options.bands > 1 {
+		input.bands = C.int(options.bands)
+		cookiesLength += options.bands
+	}
+	cookie := (*C.fz_cookie)(C.je_calloc(C.size_t(cookiesLength), C.sizeof_fz_cookie))
+	if cookie == nil {
+		return nil, errors.New("fail to allocate the cookies")
+	}
+	defer C.je_free(unsafe.Pointer(cookie))
+	cookies := unsafe.Slice(cookie, cookiesLength)
+	input.cookie = &cookies[0]
+	if cookiesLength > 1 {
+		input.band_cookies = &cookies[1]
+	}
+	switch options.colorspace {
+	case ColorspaceGray:
+		input.colorspace = C.COLORSPACE_GRAY
+	case ColorspaceAuto:
+		input.colorspace = C.COLORSPACE_AUTO
+	}
+	input.fit_width = C.int(options.fitWidth)
+	input.fit_height = C.int(options.fitHeight)
+	input.max_pixels = C.uint64_t(options.maxPixels)
+	if options.skipBlank {
+		input.skip_blank = 1
+		input.max_ink = C.float(options.maxInk)
+	}
+	var lookup *pixelLookup
+	if options.hash || options.cache != nil {
+		input.hash_pixels = 1
+	}
+	if options.cache != nil {
+		lookup = &pixelLookup{cache: options.cache}
+		handle := cgo.NewHandle(lookup)
+		defer handle.Delete()
+		input.pixel_lookup = C.uintptr_t(handle)
+	}
+	stop := abortOnDone(ctx, cookies)
+	defer stop()
+	stopProgress := watchProgress(cookies, options)
 	result := C.save_to_png(input) // nolint: gocritic
+	stopProgress()
+	stats.fill(input.cookie, result)
 	defer C.je_free(unsafe.Pointer(result.payload))
 	if result.error != nil {
 		defer C.je_free(unsafe.Pointer(result.error))
-		return fmt.Errorf("failure at the C/MuPDF layer: %s", C.GoString(result.error))
+		if result.aborted != 0 {
+			return nil, fmt.Errorf("failure at the C/MuPDF layer: %s: %w", C.GoString(result.error), context.Cause(ctx))
+		}
+		return nil, payload.check(fmt.Errorf("failure at the C/MuPDF layer: %s", C.GoString(result.error)))
+	}
+	if err := payload.check(nil); err != nil {
+		return nil, err
+	}
+	if result.blank != 0 {
+		return nil, ErrBlankPage
 	}
+	if input.hash_pixels != 0 {
+		stats.PixelHash = hex.EncodeToString(C.GoBytes(unsafe.Pointer(&result.pixel_hash[0]), C.int(len(result.pixel_hash))))
+	}
+	if result.deduplicated != 0 {
+		stats.Deduplicated = true
+		return lookup.value, nil
+	}
+	return C.GoBytes(unsafe.Pointer(result.payload), C.int(result.payload_length)), nil
+}
 
-	if _, err := output.Write([]byte(C.GoStringN(result.payload, C.int(result.payload_length)))); err != nil {
-		return fmt.Errorf("fail to write to the output: %w", err)
+// SetPixmapPoolLimit sets how many bytes of pixmap sample buffers are retained between renders to be reused. The
+// default is 64 MiB and 0 disables the pool. Buffers above the limit are released right away.
+func SetPixmapPoolLimit(bytes uint64) {
+	C.set_pixmap_pool_limit(C.size_t(bytes))
+}
+
+// SetStreamThreshold sets the size above which a page is not drawn into a single pixmap. Such pages are drawn in bands
+// into a buffer of at most 16 MiB, each band encoded as soon as it's drawn, so a render takes about the memory of the
+// buffer and the output. Every band is drawn with up to 128 extra rows above and below taken from that buffer, so the
+// wider the page the more of each band is drawn twice. The PNG is byte for byte the one of a whole pixmap with the same
+// pixels, and the pixels are the same but for images that cross the edge of a band, which MuPDF may resample slightly
+// differently. A page made of a scanned image crosses the edge of every band, so its streamed render is not byte for
+// byte the unstreamed one. The default is 256 MiB and 0 disables the streaming.
+func SetStreamThreshold(bytes uint64) {
+	C.set_stream_threshold(C.size_t(bytes))
+}
+
+// SetArenaDecay sets how long the jemalloc arenas dedicated to MuPDF keep unused dirty and muzzy pages before
+// returning them to the operating system. Zero returns them right away and a negative value disables the decay.
+func SetArenaDecay(dirty, muzzy time.Duration) error {
+	if C.set_arenas_decay(C.ssize_t(decayMilliseconds(dirty)), C.ssize_t(decayMilliseconds(muzzy))) != 0 {
+		return errors.New("fail to set the arena decay")
 	}
 	return nil
 }
 
+func decayMilliseconds(d time.Duration) int64 {
+	if d < 0 {
+		return -1
+	}
+	return d.Milliseconds()
+}
+
+// PurgeArenas returns all the unused pages held by the jemalloc arenas dedicated to MuPDF to the operating system.
+// It's meant to be called when a worker goes idle.
+func PurgeArenas() {
+	C.purge_arenas()
+}
+
+// PurgeGlyphCache drops every rendered glyph from the cache shared by the renders in flight. It's meant to be called
+// under memory pressure, the cache is emptied anyway once no render is holding a document open.
+func PurgeGlyphCache() {
+	C.purge_glyph_cache()
+}
+
+// abortOnDone sets the abort flag of the cookies once the context is done, right away when it already is. The returned
+// function must be called before the cookies are released, it waits for a write of the flags that already started.
+func abortOnDone(ctx context.Context, cookies []C.fz_cookie) (stop func()) {
+	abort := func() {
+		for i := range cookies {
+			cookies[i].abort = 1
+		}
+	}
+	if ctx.Err() != nil {
+		abort()
+	}
+	aborted := make(chan struct{})
+	stopAbort := context.AfterFunc(ctx, func() {
+		defer close(aborted)
+		abort()
+	})
+	return func() {
+		if !stopAbort() {
+			<-aborted
+		}
+	}
+}
+
+// watchProgress polls the cookies and reports their state to the progress callback until the returned function is
+// called.
+func watchProgress(cookies []C.fz_cookie, options renderOptions) (stop func()) {
+	if options.progress == nil {
+		return func() {}
+	}
+	interval := options.progressInterval
+	if interval <= 0 {
+		interval = defaultProgressInterval
+	}
+
+	done := make(chan struct{})
+	finished := make(chan struct{})
+	go func() {
+		defer close(finished)
+		ticker := time.NewTicker(interval)
+		defer ticker.Stop()
+		for {
+			select {
+			case <-ticker.C:
+				options.progress(cookieProgress(cookies))
+			case <-done:
+				return
+			}
+		}
+	}()
+	return func() {
+		close(done)
+		<-finished
+		options.progress(cookieProgress(cookies))
+	}
+}
+
+// cookieProgress reads the progress of the render from its cookie, the first one. The bands of a banded render report
+// to their own cookies once the page is recorded, the progress is then the average over the bands.
+func cookieProgress(cookies []C.fz_cookie) RenderProgress {
+	progress := RenderProgress{
+		Progress:    int(cookies[0].progress),
+		ProgressMax: -1,
+		Errors:      int(cookies[0].errors),
+	}
+	if cookies[0].progress_max != ^C.size_t(0) {
+		progress.ProgressMax = int(cookies[0].progress_max)
+	}
+	var bandsProgress, bandsMax int
+	for _, band := range cookies[1:] {
+		bandsProgress += int(band.progress)
+		bandsMax = max(bandsMax, int(band.progress_max))
+	}
+	if bandsMax > 0 {
+		progress.Progress = bandsProgress / len(cookies[1:])
+		progress.ProgressMax = bandsMax
+	}
+	return progress
+}
+
 // PageCount is used to return the page count of the document.
 func PageCount(ctx context.Context, rawPayload io.Reader) (_ int, err error) {
 	span, _ := ddTracer.StartSpanFromContext(ctx, "lazypdf.PageCount")
@@ -88,18 +337,118 @@ func PageCount(ctx context.Context, rawPayload io.Reader) (_ int, err error) {
 		return 0, errors.New("payload can't be nil")
 	}
 
-	payload, err := io.ReadAll(rawPayload)
+	payload, err := readPayload(rawPayload, true)
 	if err != nil {
-		return 0, fmt.Errorf("fail to read the payload: %w", err)
-	}
-	input := C.page_count_input{
-		payload:        (*C.char)(unsafe.Pointer(&payload[0])),
-		payload_length: C.size_t(len(payload)),
+		return 0, err
 	}
+	var input C.page_count_input
+	var release func()
+	input.payload, input.payload_length, input.payload_reader, release = payload.bind()
+	defer release()
 	output := C.page_count(input) // nolint: gocritic
 	if output.error != nil {
 		defer C.je_free(unsafe.Pointer(output.error))
-		return 0, fmt.Errorf("failure at the C/MuPDF layer: %s", C.GoString(output.error))
+		return 0, payload.check(fmt.Errorf("failure at the C/MuPDF layer: %s", C.GoString(output.error)))
+	}
+	if err := payload.check(nil); err != nil {
+		return 0, err
 	}
 	return int(output.count), nil
 }
+
+// PageCounts returns the page count of many documents with a single call to the C layer, which spreads them over its
+// worker threads, one per CPU and shared by every call. It's meant for batches of small documents, where the overhead
+// of a PageCount call for each one is noticeable. The counts and errors are returned in the same order as the
+// payloads, a document that failed has a zero count and a non nil error. Once the context is done the documents not
+// yet started fail with its cause.
+func PageCounts(ctx context.Context, payloads [][]byte) ([]int, []error) {
+	span, _ := ddTracer.StartSpanFromContext(ctx, "lazypdf.PageCounts")
+	span.SetTag("lazypdf.documents", len(payloads))
+	defer func() { span.Finish(ddTracer.WithError(context.Cause(ctx))) }()
+
+	counts := make([]int, len(payloads))
+	errs := make([]error, len(payloads))
+
+	// The inputs point to the payloads, which are pinned so the inputs can be handed to C.
+	var pinner runtime.Pinner
+	defer pinner.Unpin()
+	inputs := make([]C.page_count_input, 0, len(payloads))
+	indexes := make([]int, 0, len(payloads))
+	for i, payload := range payloads {
+		if len(payload) == 0 {
+			errs[i] = errors.New("payload can't be empty")
+			continue
+		}
+		pinner.Pin(&payload[0])
+		inputs = append(inputs, C.page_count_input{
+			payload:        (*C.char)(unsafe.Pointer(&payload[0])),
+			payload_length: C.size_t(len(payload)),
+		})
+		indexes = append(indexes, i)
+	}
+	if len(inputs) == 0 {
+		return counts, errs
+	}
+
+	// The outputs and the cookie live in C memory as the worker threads write them while Go flips the abort flag.
+	outputs := (*C.page_count_output)(C.je_calloc(C.size_t(len(inputs)), C.sizeof_page_count_output))
+	cookie := (*C.fz_cookie)(C.je_calloc(1, C.sizeof_fz_cookie))
+	defer C.je_free(unsafe.Pointer(outputs))
+	defer C.je_free(unsafe.Pointer(cookie))
+	if outputs == nil || cookie == nil {
+		err := errors.New("fail to allocate the outputs")
+		for _, i := range indexes {
+			errs[i] = err
+		}
+		return counts, errs
+	}
+	stop := abortOnDone(ctx, unsafe.Slice(cookie, 1))
+	defer stop()
+
+	input := C.page_counts_input{
+		inputs:  &inputs[0],
+		outputs: outputs,
+		length:  C.int(len(inputs)),
+		cookie:  cookie,
+	}
+	result := C.page_counts(input) // nolint: gocritic
+	if result.error != nil {
+		defer C.je_free(unsafe.Pointer(result.error))
+		err := fmt.Errorf("failure at the C/MuPDF layer: %s", C.GoString(result.error))
+		for _, i := range indexes {
+			errs[i] = err
+		}
+		return counts, errs
+	}
+	for j, output := range unsafe.Slice(outputs, len(inputs)) {
+		i := indexes[j]
+		if output.error == nil {
+			counts[i] = int(output.count)
+			continue
+		}
+		if cookie.abort != 0 && C.GoString(output.error) == "aborted" {
+			errs[i] = fmt.Errorf("failure at the C/MuPDF layer: aborted: %w", context.Cause(ctx))
+		} else {
+			errs[i] = fmt.Errorf("failure at the C/MuPDF layer: %s", C.GoString(output.error))
+		}
+		C.je_free(unsafe.Pointer(output.error))
+	}
+	return counts, errs
+}
+
+func (s *RenderStats) fill(cookie *C.fz_cookie, result C.save_to_png_output) {
+	s.Errors = int(cookie.errors)
+	s.Incomplete = result.aborted != 0 && result.error == nil
+	s.Gray = result.gray != 0
+	s.Clamped = result.clamped != 0
+	s.Streamed = result.streamed != 0
+	s.Linear = result.linear != 0
+	s.GlyphCacheBytes = uint64(result.glyph_cache)
+	s.Open = time.Duration(result.timings.open)
+	s.Load = time.Duration(result.timings.load)
+	s.Run = time.Duration(result.timings.run)
+	s.Encode = time.Duration(result.timings.encode)
+	s.PeakBytes = uint64(result.memory.peak)
+	s.TotalBytes = uint64(result.memory.total)
+	s.Allocs = uint64(result.memory.allocs)
+}
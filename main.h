@@ -3,16 +3,63 @@
 
 #include "pdf.h"
 
+// The allocator callbacks are called by MuPDF with FZ_LOCK_ALLOC held, anything else reading it must take the lock.
+typedef struct {
+	size_t current;
+	size_t peak;
+	size_t total;
+	size_t allocs;
+	size_t mem_limit;
+	size_t alloc_limit;
+} trace_info;
+
+// Wall clock time, in nanoseconds, spent at each phase of a render.
+typedef struct {
+	uint64_t open;
+	uint64_t load;
+	uint64_t run;
+	uint64_t encode;
+} phase_timings;
+
 typedef struct {
 	char *payload;
 	size_t payload_length;
+	// When set the payload is read on demand through readPayloadAt and payload_length is its size.
+	uintptr_t payload_reader;
 } page_count_input;
 
 typedef struct {
 	int count;
+	// Only open and load are set, the time to open the document and to count its pages.
+	phase_timings timings;
 	char *error;
 } page_count_output;
 
+typedef struct {
+	page_count_input *inputs;
+	// One output for each input, allocated by the caller.
+	page_count_output *outputs;
+	int length;
+	// Documents not yet started once the abort flag is set fail with "aborted".
+	fz_cookie *cookie;
+} page_counts_input;
+
+typedef struct {
+	char *error;
+} page_counts_output;
+
+enum {
+	FORMAT_PNG = 0,
+	FORMAT_JPEG = 1,
+};
+
+enum {
+	COLORSPACE_RGB = 0,
+	COLORSPACE_GRAY = 1,
+	// Gray when the page has no color, RGB otherwise.
+	COLORSPACE_AUTO = 2,
+};
+
 typedef struct {
 	int page;
 	int width;
@@ -20,18 +67,160 @@ typedef struct {
 	int dpi;
 	char *payload;
 	size_t payload_length;
+	uintptr_t payload_reader;
 	fz_cookie *cookie;
+	int best_effort;
+	int bands;
+	// One cookie per band, when set, so aborting them stops the bands being drawn.
+	fz_cookie *band_cookies;
+	int colorspace;
+	// When set, pages with at most max_ink of their pixels with ink are reported as blank and not encoded.
+	int skip_blank;
+	float max_ink;
+	// When set the pixels are hashed before encoding. A non zero pixel_lookup is passed to lookupPixelHash to find out
+	// if an output with the same pixels already exists, in which case the page is not encoded.
+	int hash_pixels;
+	uintptr_t pixel_lookup;
+	// When either is set the page is scaled to fit within fit_width x fit_height pixels instead of following width and
+	// scale, a zero dimension is unbounded.
+	int fit_width;
+	int fit_height;
+	// When set the scale is reduced until the page takes at most max_pixels.
+	uint64_t max_pixels;
+	// Renders with the same non zero key go to the same engine shard, the others are spread round-robin.
+	uint64_t shard_key;
 } save_to_png_input;
 
+// Memory allocated by MuPDF on behalf of a single render.
+typedef struct {
+	size_t peak;
+	size_t total;
+	size_t allocs;
+} render_memory;
+
 typedef struct {
 	char *payload;
 	size_t payload_length;
+	int aborted;
+	int blank;
+	int gray;
+	unsigned char pixel_hash[16];
+	int deduplicated;
+	int clamped;
+	// Set when the page was drawn and encoded in bands because its pixmap was above the stream threshold.
+	int streamed;
+	// Set when the page was rendered from the first page section of a linearized document alone.
+	int linear;
+	// Size of the glyph cache once the page was drawn, before the document is dropped.
+	size_t glyph_cache;
+	phase_timings timings;
+	render_memory memory;
 	char *error;
 } save_to_png_output;
 
+// Counters of one of the MuPDF global locks.
+typedef struct {
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t hold_ns;
+} lock_stats;
+
+// Snapshot of the process wide state of the engine.
+typedef struct {
+	trace_info memory;
+	size_t store_max;
+	size_t store_size;
+	size_t glyph_cache_size;
+	size_t allocated;
+	size_t active;
+	size_t resident;
+	size_t retained;
+	size_t mapped;
+	unsigned arenas;
+	size_t arenas_dirty;
+	size_t arenas_muzzy;
+	size_t pixmap_pool_limit;
+	size_t pixmap_pool_retained;
+	size_t pixmap_pool_hits;
+	size_t pixmap_pool_misses;
+	unsigned shards;
+	int lock_spinning;
+	int lock_instrumented;
+	lock_stats locks[FZ_LOCK_MAX];
+	int active_renders;
+	int active_page_counts;
+	int queued_tasks;
+	int queued_calls;
+} engine_stats;
+
+typedef struct {
+	int page;
+	char *payload;
+	size_t payload_length;
+	// Resolution of the gray render used to measure the ink, 0 skips it.
+	int ink_dpi;
+	fz_cookie *cookie;
+} page_content_input;
+
+typedef struct {
+	// Area of the page covered by anything drawn, in the same space as the page bounds.
+	fz_rect content;
+	// Fraction of the pixels, from 0 to 1, with ink.
+	float ink;
+	int aborted;
+	char *error;
+} page_content_output;
+
+typedef struct {
+	int width;
+	float scale;
+	int dpi;
+	int format;
+	int quality;
+	// Same as the max_pixels of save_to_png.
+	uint64_t max_pixels;
+} rendition_spec;
+
+typedef struct {
+	int page;
+	char *payload;
+	size_t payload_length;
+	rendition_spec *specs;
+	int specs_length;
+	// One cookie for the interpretation of the page followed by one for each rendition.
+	fz_cookie *cookies;
+} render_renditions_input;
+
+typedef struct {
+	char *payload;
+	size_t payload_length;
+	char *error;
+} rendition_output;
+
+typedef struct {
+	rendition_output *outputs;
+	int aborted;
+	char *error;
+} render_renditions_output;
+
+// Implemented in Go.
+int lookupPixelHash(uintptr_t handle, unsigned char *hash);
+int64_t readPayloadAt(uintptr_t handle, unsigned char *buffer, int64_t length, int64_t offset);
+
 void init();
+engine_stats get_engine_stats();
+void reset_trace_peak();
+void set_pixmap_pool_limit(size_t limit);
+void set_stream_threshold(size_t threshold);
+int set_arenas_decay(ssize_t dirty_decay_ms, ssize_t muzzy_decay_ms);
+void purge_arenas();
+void purge_glyph_cache();
 
 page_count_output page_count(page_count_input input);
+page_counts_output page_counts(page_counts_input input);
 save_to_png_output save_to_png(save_to_png_input input);
+page_content_output page_content(page_content_input input);
+render_renditions_output render_renditions(render_renditions_input input);
 
 #endif
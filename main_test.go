@@ -3,11 +3,25 @@ package lazypdf
 import (
 	"bytes"
 	"context"
+	"crypto/sha256"
+	"encoding/hex"
+	"errors"
 	"fmt"
+	"image"
+	"image/jpeg"
+	"image/png"
 	"io"
 	"os"
+	"os/exec"
+	"runtime"
+	"slices"
+	"sort"
+	"strconv"
+	"sync"
 	"testing"
+	"time"
 
+	"github.com/stretchr/testify/assert"
 	"github.com/stretchr/testify/require"
 )
 
@@ -29,6 +43,83 @@ func TestSaveToPNGOK(t *testing.T) {
 	}
 }
 
+func TestSaveToPNGBands(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+
+	for i := uint16(0); i < 13; i++ {
+		buf := bytes.NewBuffer([]byte{})
+		err = SaveToPNG(context.Background(), i, 0, 0, 0, bytes.NewReader(payload), buf, WithBands(7))
+		require.NoError(t, err)
+		actual, err := png.Decode(buf)
+		require.NoError(t, err)
+
+		file, err := os.Open(fmt.Sprintf("testdata/sample_page%d.png", i))
+		require.NoError(t, err)
+		expected, err := png.Decode(file)
+		require.NoError(t, err)
+		require.NoError(t, file.Close())
+
+		// Images crossing a band edge are resampled per band, everything else must match.
+		bounds := expected.Bounds()
+		require.Equal(t, bounds, actual.Bounds())
+		var diff uint64
+		for y := bounds.Min.Y; y < bounds.Max.Y; y++ {
+			for x := bounds.Min.X; x < bounds.Max.X; x++ {
+				r1, g1, b1, _ := expected.At(x, y).RGBA()
+				r2, g2, b2, _ := actual.At(x, y).RGBA()
+				diff += absDiff(r1>>8, r2>>8) + absDiff(g1>>8, g2>>8) + absDiff(b1>>8, b2>>8)
+			}
+		}
+		require.Less(t, float64(diff)/float64(3*bounds.Dx()*bounds.Dy()), 1.0)
+	}
+}
+
+// TestSaveToPNGBandsCancel cancels a banded render once the bands report progress, which must stop the bands being
+// drawn.
+func TestSaveToPNGBandsCancel(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+	var last RenderProgress
+	progress := func(p RenderProgress) {
+		last = p
+		if p.ProgressMax > 0 && p.Progress > 0 {
+			cancel()
+		}
+	}
+	err = SaveToPNG(
+		ctx, 3, 0, 8, 0, bytes.NewReader(payload), io.Discard, WithBands(8), WithProgress(time.Millisecond, progress),
+	)
+	require.ErrorIs(t, err, context.Canceled)
+	require.Greater(t, last.ProgressMax, 0)
+	require.Less(t, last.Progress, last.ProgressMax)
+}
+
+// TestSaveToPNGBandsMemory checks that the allocations made by the threads drawing the bands are counted.
+func TestSaveToPNGBandsMemory(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+
+	var plain, banded RenderStats
+	err = SaveToPNG(context.Background(), 3, 0, 2, 0, bytes.NewReader(payload), io.Discard, WithRenderStats(&plain))
+	require.NoError(t, err)
+	err = SaveToPNG(
+		context.Background(), 3, 0, 2, 0, bytes.NewReader(payload), io.Discard, WithBands(8), WithRenderStats(&banded),
+	)
+	require.NoError(t, err)
+	require.Greater(t, banded.Allocs, plain.Allocs*3/4)
+}
+
+func absDiff(a, b uint32) uint64 {
+	if a > b {
+		return uint64(a - b)
+	}
+	return uint64(b - a)
+}
+
 func TestSaveToPNGFail(t *testing.T) {
 	file, err := os.Open("testdata/sample-invalid.pdf")
 	require.NoError(t, err)
@@ -59,6 +150,144 @@ func TestPageCountFail(t *testing.T) {
 	require.Equal(t, "failure at the C/MuPDF layer: no objects found", err.Error())
 }
 
+func TestPageCounts(t *testing.T) {
+	sample, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	blank, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+	invalid, err := os.ReadFile("testdata/sample-invalid.pdf")
+	require.NoError(t, err)
+
+	counts, errs := PageCounts(context.Background(), [][]byte{sample, invalid, nil, blank, sample})
+	require.Equal(t, []int{13, 0, 0, 3, 13}, counts)
+	require.NoError(t, errs[0])
+	require.EqualError(t, errs[1], "failure at the C/MuPDF layer: no objects found")
+	require.EqualError(t, errs[2], "payload can't be empty")
+	require.NoError(t, errs[3])
+	require.NoError(t, errs[4])
+
+	ctx, cancel := context.WithCancel(context.Background())
+	cancel()
+	counts, errs = PageCounts(ctx, [][]byte{sample, blank})
+	require.Equal(t, []int{0, 0}, counts)
+	for _, err := range errs {
+		require.ErrorIs(t, err, context.Canceled)
+	}
+}
+
+// TestPageCountsConcurrent counts and renders in bands from many goroutines at once. All of them share the worker
+// threads, every result must match the one of a call made alone and the queue of the pool must be empty afterwards.
+func TestPageCountsConcurrent(t *testing.T) {
+	sample, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	blank, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+
+	expected := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(context.Background(), 2, 0, 0, 0, bytes.NewReader(sample), expected, WithBands(4))
+	require.NoError(t, err)
+
+	var wg sync.WaitGroup
+	for i := 0; i < 8; i++ {
+		wg.Add(2)
+		go func() {
+			defer wg.Done()
+			counts, errs := PageCounts(context.Background(), [][]byte{sample, blank, sample, blank})
+			assert.Equal(t, []int{13, 3, 13, 3}, counts)
+			assert.Equal(t, []error{nil, nil, nil, nil}, errs)
+		}()
+		go func() {
+			defer wg.Done()
+			buf := bytes.NewBuffer([]byte{})
+			err := SaveToPNG(context.Background(), 2, 0, 0, 0, bytes.NewReader(sample), buf, WithBands(4))
+			assert.NoError(t, err)
+			assert.Equal(t, expected.Bytes(), buf.Bytes())
+		}()
+	}
+	wg.Wait()
+	stats := Stats()
+	require.Equal(t, 0, stats.QueuedTasks)
+	require.Equal(t, 0, stats.QueuedCalls)
+}
+
+// TestSaveToPNGBandsDuringBatch renders in bands while a large PageCounts batch is queued at the worker threads. The
+// render must not wait for the batch to be done.
+func TestSaveToPNGBandsDuringBatch(t *testing.T) {
+	sample, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	blank, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+	payloads := make([][]byte, 30000)
+	for i := range payloads {
+		payloads[i] = blank
+	}
+
+	expected := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(context.Background(), 2, 0, 0, 0, bytes.NewReader(sample), expected, WithBands(4))
+	require.NoError(t, err)
+
+	done := make(chan []error, 1)
+	go func() {
+		_, errs := PageCounts(context.Background(), payloads)
+		done <- errs
+	}()
+	for Stats().QueuedCalls == 0 {
+		select {
+		case errs := <-done:
+			t.Fatalf("the batch was never seen at the queue, first error: %v", errs[0])
+		default:
+		}
+	}
+
+	buf := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(context.Background(), 2, 0, 0, 0, bytes.NewReader(sample), buf, WithBands(4))
+	require.NoError(t, err)
+	require.Equal(t, expected.Bytes(), buf.Bytes())
+	require.Greater(t, Stats().QueuedCalls, 0, "the render waited for the batch")
+	require.NoError(t, (<-done)[0])
+}
+
+func BenchmarkPageCounts(b *testing.B) {
+	buf, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(b, err)
+	payloads := make([][]byte, 100)
+	for i := range payloads {
+		payloads[i] = buf
+	}
+
+	b.ReportAllocs()
+	b.ReportMetric(0, "ns/op")
+	start := time.Now()
+	for i := 0; i < b.N; i++ {
+		_, errs := PageCounts(context.Background(), payloads)
+		require.NoError(b, errs[0])
+	}
+	b.ReportMetric(float64(time.Since(start).Nanoseconds())/float64(b.N*len(payloads)), "ns/document")
+}
+
+func BenchmarkPageCount(b *testing.B) {
+	buf, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(b, err)
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		_, err := PageCount(context.Background(), bytes.NewReader(buf))
+		require.NoError(b, err)
+	}
+}
+
+// BenchmarkPageCountSmall measures the fixed cost of a call into the engine, which dominates on small documents.
+func BenchmarkPageCountSmall(b *testing.B) {
+	buf, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(b, err)
+
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		_, err := PageCount(context.Background(), bytes.NewReader(buf))
+		require.NoError(b, err)
+	}
+}
+
 func BenchmarkSaveToPNGPage0(b *testing.B)  { benchmarkSaveToPNGRunner(0, b) }
 func BenchmarkSaveToPNGPage1(b *testing.B)  { benchmarkSaveToPNGRunner(1, b) }
 func BenchmarkSaveToPNGPage2(b *testing.B)  { benchmarkSaveToPNGRunner(2, b) }
@@ -77,11 +306,1059 @@ func benchmarkSaveToPNGRunner(page uint16, b *testing.B) {
 	buf, err := os.ReadFile("testdata/sample.pdf")
 	require.NoError(b, err)
 
+	var peak, total, allocs uint64
 	b.ReportAllocs()
 	for i := 0; i < b.N; i++ {
+		var stats RenderStats
 		input := bytes.NewBuffer(buf)
 		output := bytes.NewBuffer([]byte{})
-		err := SaveToPNG(context.Background(), page, 0, 0, 0, input, output)
+		err := SaveToPNG(context.Background(), page, 0, 0, 0, input, output, WithRenderStats(&stats))
+		require.NoError(b, err)
+		peak = max(peak, stats.PeakBytes)
+		total += stats.TotalBytes
+		allocs += stats.Allocs
+	}
+	b.ReportMetric(float64(peak), "peak-native-B")
+	b.ReportMetric(float64(total)/float64(b.N), "native-B/op")
+	b.ReportMetric(float64(allocs)/float64(b.N), "native-allocs/op")
+}
+
+func TestSaveToPNGNoGoroutineLeak(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+
+	before := runtime.NumGoroutine()
+	for i := 0; i < 100; i++ {
+		err := SaveToPNG(ctx, 0, 10, 0, 0, bytes.NewReader(payload), io.Discard)
+		require.NoError(t, err)
+	}
+	require.LessOrEqual(t, runtime.NumGoroutine(), before)
+}
+
+// BenchmarkSaveToPNGGoroutines is a soak test for the cancellation wiring. Run it with a fixed iteration count, like
+// `-benchtime=1000000x`, to check that the goroutine count stays flat across a large number of renders.
+func BenchmarkSaveToPNGGoroutines(b *testing.B) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(b, err)
+
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+
+	before := runtime.NumGoroutine()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		err := SaveToPNG(ctx, 0, 10, 0, 0, bytes.NewReader(payload), io.Discard)
 		require.NoError(b, err)
 	}
+	b.StopTimer()
+
+	leaked := runtime.NumGoroutine() - before
+	b.ReportMetric(float64(leaked), "goroutines")
+	require.LessOrEqual(b, leaked, 0)
+}
+
+func TestSaveToPNGProgress(t *testing.T) {
+	file, err := os.Open("testdata/sample.pdf")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, file.Close()) }()
+
+	var (
+		stats    RenderStats
+		progress []RenderProgress
+	)
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, file, io.Discard,
+		WithRenderStats(&stats),
+		WithProgress(time.Millisecond, func(p RenderProgress) { progress = append(progress, p) }),
+	)
+	require.NoError(t, err)
+	require.NotEmpty(t, progress)
+
+	last := progress[len(progress)-1]
+	require.Greater(t, last.Progress, 0)
+	require.Equal(t, stats.Errors, last.Errors)
+	for i := 1; i < len(progress); i++ {
+		require.GreaterOrEqual(t, progress[i].Progress, progress[i-1].Progress)
+	}
+}
+
+func TestSaveToPNGAborted(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+
+	ctx, cancel := context.WithCancel(context.Background())
+	cancel()
+
+	err = SaveToPNG(ctx, 0, 0, 0, 0, bytes.NewReader(payload), bytes.NewBuffer([]byte{}))
+	require.Error(t, err)
+	require.ErrorIs(t, err, context.Canceled)
+}
+
+func TestSaveToPNGBestEffort(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+
+	ctx, cancel := context.WithCancel(context.Background())
+	cancel()
+
+	var stats RenderStats
+	buf := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(ctx, 0, 0, 0, 0, bytes.NewReader(payload), buf, WithBestEffort(), WithRenderStats(&stats))
+	require.NoError(t, err)
+	require.True(t, stats.Incomplete)
+
+	partial, err := png.Decode(buf)
+	require.NoError(t, err)
+	expected, err := os.Open("testdata/sample_page0.png")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, expected.Close()) }()
+	complete, err := png.Decode(expected)
+	require.NoError(t, err)
+	require.Equal(t, complete.Bounds(), partial.Bounds())
+
+	stats = RenderStats{}
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), io.Discard, WithBestEffort(), WithRenderStats(&stats),
+	)
+	require.NoError(t, err)
+	require.False(t, stats.Incomplete)
+}
+
+func BenchmarkSaveToPNGParallel(b *testing.B) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(b, err)
+
+	benchmarkParallelRunner(b, func() error {
+		return SaveToPNG(context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), io.Discard)
+	})
+}
+
+func BenchmarkPageCountParallel(b *testing.B) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(b, err)
+
+	benchmarkParallelRunner(b, func() error {
+		_, err := PageCount(context.Background(), bytes.NewReader(payload))
+		return err
+	})
+}
+
+// benchmarkParallelRunner runs fn with 1, 2, 4, ... goroutines up to the number of CPUs and reports the throughput, the
+// latency percentiles and the peak of memory allocated by MuPDF at each level.
+func benchmarkParallelRunner(b *testing.B, fn func() error) {
+	levels := []int{}
+	for n := 1; n < runtime.NumCPU(); n *= 2 {
+		levels = append(levels, n)
+	}
+	levels = append(levels, runtime.NumCPU())
+
+	for _, goroutines := range levels {
+		b.Run(fmt.Sprintf("goroutines=%d", goroutines), func(b *testing.B) {
+			defer runtime.GOMAXPROCS(runtime.GOMAXPROCS(goroutines))
+
+			var (
+				mutex     sync.Mutex
+				latencies = make([]time.Duration, 0, b.N)
+			)
+			resetNativeMemoryPeak()
+			wait := lockWait()
+			b.ReportAllocs()
+			b.ResetTimer()
+			start := time.Now()
+			b.RunParallel(func(pb *testing.PB) {
+				local := make([]time.Duration, 0, b.N/goroutines+1)
+				for pb.Next() {
+					begin := time.Now()
+					if err := fn(); err != nil {
+						b.Error(err)
+						return
+					}
+					local = append(local, time.Since(begin))
+				}
+				mutex.Lock()
+				latencies = append(latencies, local...)
+				mutex.Unlock()
+			})
+			elapsed := time.Since(start)
+			b.StopTimer()
+
+			sort.Slice(latencies, func(i, j int) bool { return latencies[i] < latencies[j] })
+			percentile := func(p float64) float64 {
+				if len(latencies) == 0 {
+					return 0
+				}
+				return float64(latencies[int(float64(len(latencies)-1)*p)].Nanoseconds())
+			}
+			b.ReportMetric(float64(len(latencies))/elapsed.Seconds(), "pages/s")
+			b.ReportMetric(percentile(0.50), "p50-ns")
+			b.ReportMetric(percentile(0.99), "p99-ns")
+			b.ReportMetric(float64(Stats().Memory.Peak), "peak-native-B")
+			if Stats().Locks != nil {
+				b.ReportMetric(float64((lockWait()-wait).Nanoseconds())/float64(len(latencies)), "lock-wait-ns/op")
+			}
+		})
+	}
+}
+
+// lockWait returns the time spent waiting for the MuPDF global locks, zero unless LAZYPDF_LOCK_STATS is set.
+func lockWait() time.Duration {
+	var wait time.Duration
+	for _, lock := range Stats().Locks {
+		wait += lock.Wait
+	}
+	return wait
+}
+
+func TestSaveToPNGStats(t *testing.T) {
+	file, err := os.Open("testdata/sample.pdf")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, file.Close()) }()
+
+	var stats RenderStats
+	err = SaveToPNG(context.Background(), 0, 0, 0, 0, file, io.Discard, WithRenderStats(&stats))
+	require.NoError(t, err)
+	require.Greater(t, stats.Open, time.Duration(0))
+	require.Greater(t, stats.Run, time.Duration(0))
+	require.Greater(t, stats.Encode, time.Duration(0))
+	require.Greater(t, stats.Allocs, uint64(0))
+	require.GreaterOrEqual(t, stats.TotalBytes, stats.PeakBytes)
+	require.Greater(t, stats.PeakBytes, uint64(0))
+}
+
+func TestStats(t *testing.T) {
+	file, err := os.Open("testdata/sample.pdf")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, file.Close()) }()
+
+	err = SaveToPNG(context.Background(), 0, 0, 0, 0, file, io.Discard)
+	require.NoError(t, err)
+
+	stats := Stats()
+	require.Greater(t, stats.Memory.Total, uint64(0))
+	require.GreaterOrEqual(t, stats.Memory.Peak, stats.Memory.Current)
+	require.Equal(t, uint64(256<<20), stats.StoreLimit)
+	require.LessOrEqual(t, stats.StoreSize, stats.StoreLimit)
+	require.Greater(t, stats.Jemalloc.Allocated, uint64(0))
+	require.GreaterOrEqual(t, stats.Jemalloc.Resident, stats.Jemalloc.Active)
+	require.Equal(t, 0, stats.ActiveRenders)
+	require.Equal(t, 0, stats.ActivePageCounts)
+	require.Equal(t, 0, stats.QueuedTasks)
+	require.Equal(t, 0, stats.QueuedCalls)
+}
+
+// TestStatsQueue watches the queue of the worker threads while a large PageCounts batch runs.
+func TestStatsQueue(t *testing.T) {
+	blank, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+	payloads := make([][]byte, 5000)
+	for i := range payloads {
+		payloads[i] = blank
+	}
+
+	done := make(chan []error)
+	go func() {
+		_, errs := PageCounts(context.Background(), payloads)
+		done <- errs
+	}()
+	var queued EngineStats
+	for queued.QueuedCalls == 0 {
+		select {
+		case errs := <-done:
+			t.Fatalf("the batch was never seen at the queue, first error: %v", errs[0])
+		default:
+			queued = Stats()
+		}
+	}
+	require.Equal(t, 1, queued.QueuedTasks)
+	require.LessOrEqual(t, queued.QueuedCalls, len(payloads))
+
+	errs := <-done
+	require.NoError(t, errs[0])
+	stats := Stats()
+	require.Equal(t, 0, stats.QueuedTasks)
+	require.Equal(t, 0, stats.QueuedCalls)
+}
+
+func TestPixmapPool(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	expected, err := os.ReadFile("testdata/sample_page3.png")
+	require.NoError(t, err)
+
+	render := func() {
+		buf := bytes.NewBuffer([]byte{})
+		err := SaveToPNG(context.Background(), 3, 0, 0, 0, bytes.NewReader(payload), buf)
+		require.NoError(t, err)
+		require.Equal(t, expected, buf.Bytes())
+	}
+
+	render()
+	before := Stats().PixmapPool
+	require.Greater(t, before.Retained, uint64(0))
+	render()
+	after := Stats().PixmapPool
+	require.Equal(t, before.Hits+1, after.Hits)
+	require.Equal(t, before.Misses, after.Misses)
+
+	SetPixmapPoolLimit(0)
+	defer SetPixmapPoolLimit(64 << 20)
+	require.Equal(t, uint64(0), Stats().PixmapPool.Retained)
+	render()
+	pool := Stats().PixmapPool
+	require.Equal(t, after.Hits, pool.Hits)
+	require.Equal(t, after.Misses, pool.Misses)
+	require.Equal(t, uint64(0), pool.Retained)
+}
+
+// TestArenas runs itself again at a new process with a set number of arenas. The default follows the online CPUs as
+// seen by sysconf, which may differ from runtime.NumCPU under a cpuset.
+func TestArenas(t *testing.T) {
+	if os.Getenv("LAZYPDF_ARENAS") == "" {
+		require.Greater(t, Stats().Jemalloc.Arenas, 0)
+		runWithEnv(t, "TestArenas", "LAZYPDF_ARENAS=3")
+	} else {
+		arenas, err := strconv.Atoi(os.Getenv("LAZYPDF_ARENAS"))
+		require.NoError(t, err)
+		require.Equal(t, arenas, Stats().Jemalloc.Arenas)
+	}
+
+	file, err := os.Open("testdata/sample.pdf")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, file.Close()) }()
+
+	require.NoError(t, SetArenaDecay(time.Hour, time.Hour))
+	defer func() { require.NoError(t, SetArenaDecay(10*time.Second, 10*time.Second)) }()
+
+	err = SaveToPNG(context.Background(), 0, 0, 0, 0, file, io.Discard)
+	require.NoError(t, err)
+
+	PurgeArenas()
+	stats := Stats().Jemalloc
+	require.Equal(t, uint64(0), stats.ArenasDirty)
+	require.Equal(t, uint64(0), stats.ArenasMuzzy)
+}
+
+// TestLocks runs itself again at a new process to check the lock settings, which are only read at initialization.
+func TestLocks(t *testing.T) {
+	if os.Getenv("LAZYPDF_LOCK_STATS") == "" {
+		require.False(t, Stats().LockSpinning)
+		require.Nil(t, Stats().Locks)
+
+		runWithEnv(t, "TestLocks", "LAZYPDF_LOCK_STATS=1", "LAZYPDF_LOCKS=spin")
+		return
+	}
+
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	err = SaveToPNG(context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), io.Discard)
+	require.NoError(t, err)
+
+	stats := Stats()
+	require.Equal(t, os.Getenv("LAZYPDF_LOCKS") == "spin", stats.LockSpinning)
+	require.Len(t, stats.Locks, 3)
+	alloc := stats.Locks[0]
+	require.Equal(t, "alloc", alloc.Name)
+	require.NotZero(t, alloc.Acquisitions)
+	require.NotZero(t, alloc.Hold)
+	require.LessOrEqual(t, alloc.Contended, alloc.Acquisitions)
+}
+
+// TestShards runs itself again at a new process with shards, which are only created at initialization.
+func TestShards(t *testing.T) {
+	if os.Getenv("LAZYPDF_SHARDS") == "" {
+		require.Equal(t, 1, Stats().Shards)
+		runWithEnv(t, "TestShards", "LAZYPDF_SHARDS=4")
+		return
+	}
+
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	var wg sync.WaitGroup
+	for i := 0; i < 8; i++ {
+		wg.Add(1)
+		go func(page uint16) {
+			defer wg.Done()
+			err := SaveToPNG(context.Background(), page, 0, 0.5, 0, bytes.NewReader(payload), io.Discard, WithContentHash())
+			assert.NoError(t, err)
+		}(uint16(i))
+	}
+	wg.Wait()
+
+	shards, err := strconv.Atoi(os.Getenv("LAZYPDF_SHARDS"))
+	require.NoError(t, err)
+	stats := Stats()
+	require.Equal(t, shards, stats.Shards)
+	require.Equal(t, uint64(256<<20)/uint64(shards)*uint64(shards), stats.StoreLimit)
+	require.NotZero(t, stats.Memory.Allocs)
+}
+
+// runWithEnv runs a single test at a new process with the given environment variables.
+func runWithEnv(t *testing.T, test string, env ...string) {
+	t.Helper()
+	cmd := exec.Command(os.Args[0], "-test.run=^"+test+"$") // nolint: gosec
+	cmd.Env = append(os.Environ(), env...)
+	output, err := cmd.CombinedOutput()
+	require.NoError(t, err, string(output))
+}
+
+func TestGlyphCache(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+
+	var stats RenderStats
+	err = SaveToPNG(context.Background(), 1, 0, 0, 0, bytes.NewReader(payload), io.Discard, WithRenderStats(&stats))
+	require.NoError(t, err)
+	require.NotZero(t, stats.GlyphCacheBytes)
+
+	// The document was dropped, which empties the cache.
+	require.Zero(t, Stats().GlyphCacheSize)
+	PurgeGlyphCache()
+	require.Zero(t, Stats().GlyphCacheSize)
+}
+
+// BenchmarkSaveToPNGGlyphCache renders a text heavy page at many zoom levels, every zoom needs its own glyphs. The
+// glyph-KiB metric is how much of the 1 MiB cache the page takes, past it MuPDF empties the cache mid render and the
+// glyphs are rendered again.
+func BenchmarkSaveToPNGGlyphCache(b *testing.B) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(b, err)
+
+	for _, scale := range []float32{0.5, 0.75, 1, 1.25, 1.5, 2, 3, 4} {
+		b.Run(fmt.Sprintf("scale=%g", scale), func(b *testing.B) {
+			var stats RenderStats
+			for i := 0; i < b.N; i++ {
+				err := SaveToPNG(
+					context.Background(), 1, 0, scale, 0, bytes.NewReader(payload), io.Discard, WithRenderStats(&stats),
+				)
+				require.NoError(b, err)
+			}
+			b.ReportMetric(float64(stats.GlyphCacheBytes)/1024, "glyph-KiB")
+		})
+	}
+}
+
+func TestRenderRenditions(t *testing.T) {
+	file, err := os.Open("testdata/sample.pdf")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, file.Close()) }()
+
+	renditions, err := RenderRenditions(context.Background(), 0, file, []RenditionSpec{
+		{},
+		{Width: 100},
+		{Scale: 2, Format: JPEG},
+		{Scale: 4, MaxPixels: 50_000},
+	})
+	require.NoError(t, err)
+	require.Len(t, renditions, 4)
+
+	expected, err := os.ReadFile("testdata/sample_page0.png")
+	require.NoError(t, err)
+	require.Equal(t, expected, renditions[0])
+
+	thumbnail, err := png.Decode(bytes.NewReader(renditions[1]))
+	require.NoError(t, err)
+	require.Equal(t, 100, thumbnail.Bounds().Dx())
+
+	large, err := jpeg.Decode(bytes.NewReader(renditions[2]))
+	require.NoError(t, err)
+	buf := bytes.NewBuffer([]byte{})
+	_, err = file.Seek(0, io.SeekStart)
+	require.NoError(t, err)
+	require.NoError(t, SaveToPNG(context.Background(), 0, 0, 2, 0, file, buf))
+	scaled, err := png.Decode(buf)
+	require.NoError(t, err)
+	require.Equal(t, scaled.Bounds(), large.Bounds())
+
+	clamped, err := png.DecodeConfig(bytes.NewReader(renditions[3]))
+	require.NoError(t, err)
+	require.LessOrEqual(t, clamped.Width*clamped.Height, 50_000)
+}
+
+func TestRenderRenditionsFail(t *testing.T) {
+	file, err := os.Open("testdata/sample-invalid.pdf")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, file.Close()) }()
+
+	_, err = RenderRenditions(context.Background(), 0, file, []RenditionSpec{{}})
+	require.Error(t, err)
+	require.Equal(t, "failure at the C/MuPDF layer: no objects found", err.Error())
+}
+
+func TestContentBounds(t *testing.T) {
+	payload, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+
+	bounds, err := ContentBounds(context.Background(), 0, bytes.NewReader(payload))
+	require.NoError(t, err)
+	require.True(t, bounds.Empty())
+
+	bounds, err = ContentBounds(context.Background(), 1, bytes.NewReader(payload))
+	require.NoError(t, err)
+	require.Equal(t, Rect{X0: 0, Y0: 0, X1: 612, Y1: 792}, bounds)
+
+	bounds, err = ContentBounds(context.Background(), 2, bytes.NewReader(payload))
+	require.NoError(t, err)
+	require.Equal(t, Rect{X0: 100, Y0: 142, X1: 150, Y1: 192}, bounds)
+}
+
+func TestIsBlank(t *testing.T) {
+	payload, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+
+	// The second page is covered by a white rectangle, only the ink check finds out it's blank.
+	tests := []struct {
+		page   uint16
+		maxInk float64
+		blank  bool
+	}{
+		{page: 0, maxInk: 0, blank: true},
+		{page: 1, maxInk: 0, blank: false},
+		{page: 1, maxInk: 0.001, blank: true},
+		{page: 2, maxInk: 0.001, blank: false},
+		{page: 2, maxInk: 0.01, blank: true},
+	}
+	for _, tt := range tests {
+		blank, err := IsBlank(context.Background(), tt.page, bytes.NewReader(payload), tt.maxInk)
+		require.NoError(t, err)
+		require.Equal(t, tt.blank, blank, "page %d with max ink %f", tt.page, tt.maxInk)
+	}
+
+	_, err = IsBlank(context.Background(), 3, bytes.NewReader(payload), 0)
+	require.Error(t, err)
+}
+
+func TestSaveToPNGSkipBlank(t *testing.T) {
+	payload, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+
+	for _, page := range []uint16{0, 1} {
+		buf := bytes.NewBuffer([]byte{})
+		err = SaveToPNG(context.Background(), page, 0, 0, 0, bytes.NewReader(payload), buf, WithSkipBlank(0))
+		require.ErrorIs(t, err, ErrBlankPage)
+		require.Zero(t, buf.Len())
+	}
+
+	buf := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(context.Background(), 2, 0, 0, 0, bytes.NewReader(payload), buf, WithSkipBlank(0))
+	require.NoError(t, err)
+	require.NotZero(t, buf.Len())
+}
+
+func TestSaveToPNGColorspace(t *testing.T) {
+	payload, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+
+	var stats RenderStats
+	buf := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(
+		context.Background(), 2, 0, 0, 0, bytes.NewReader(payload), buf,
+		WithColorspace(ColorspaceAuto), WithRenderStats(&stats),
+	)
+	require.NoError(t, err)
+	require.True(t, stats.Gray)
+	img, err := png.Decode(buf)
+	require.NoError(t, err)
+	require.IsType(t, &image.Gray{}, img)
+
+	payload, err = os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	expectedPage, err := os.ReadFile("testdata/sample_page0.png")
+	require.NoError(t, err)
+
+	buf = bytes.NewBuffer([]byte{})
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), buf,
+		WithColorspace(ColorspaceAuto), WithRenderStats(&stats),
+	)
+	require.NoError(t, err)
+	require.False(t, stats.Gray)
+	require.Equal(t, expectedPage, buf.Bytes())
+
+	buf = bytes.NewBuffer([]byte{})
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), buf,
+		WithColorspace(ColorspaceGray), WithRenderStats(&stats),
+	)
+	require.NoError(t, err)
+	require.True(t, stats.Gray)
+	img, err = png.Decode(buf)
+	require.NoError(t, err)
+	require.IsType(t, &image.Gray{}, img)
+	require.Equal(t, image.Rect(0, 0, 1191, 842), img.Bounds())
+}
+
+func TestSaveToPNGFit(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+
+	render := func(opts ...RenderOption) (image.Rectangle, RenderStats) {
+		var stats RenderStats
+		buf := bytes.NewBuffer([]byte{})
+		opts = append(opts, WithRenderStats(&stats))
+		err := SaveToPNG(context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), buf, opts...)
+		require.NoError(t, err)
+		config, err := png.DecodeConfig(buf)
+		require.NoError(t, err)
+		return image.Rect(0, 0, config.Width, config.Height), stats
+	}
+
+	bounds, _ := render(WithFit(400, 400))
+	require.Equal(t, image.Rect(0, 0, 400, 283), bounds)
+	bounds, _ = render(WithFit(0, 100))
+	require.Equal(t, image.Rect(0, 0, 142, 100), bounds)
+
+	bounds, stats := render(WithMaxPixels(100_000))
+	require.True(t, stats.Clamped)
+	require.LessOrEqual(t, bounds.Dx()*bounds.Dy(), 100_000)
+	require.Greater(t, bounds.Dx()*bounds.Dy(), 99_000)
+	require.InDelta(t, 1191.0/842, float64(bounds.Dx())/float64(bounds.Dy()), 0.01)
+
+	bounds, stats = render(WithMaxPixels(2_000_000))
+	require.False(t, stats.Clamped)
+	require.Equal(t, image.Rect(0, 0, 1191, 842), bounds)
+}
+
+func TestSaveToPNGStreamed(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	expectedPage, err := os.ReadFile("testdata/sample_page1.png")
+	require.NoError(t, err)
+
+	var whole RenderStats
+	err = SaveToPNG(
+		context.Background(), 1, 0, 0, 0, bytes.NewReader(payload), io.Discard, WithContentHash(), WithRenderStats(&whole),
+	)
+	require.NoError(t, err)
+	require.False(t, whole.Streamed)
+
+	SetStreamThreshold(1 << 20)
+	defer SetStreamThreshold(256 << 20)
+	var stats RenderStats
+	buf := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(
+		context.Background(), 1, 0, 0, 0, bytes.NewReader(payload), buf, WithContentHash(), WithRenderStats(&stats),
+	)
+	require.NoError(t, err)
+	require.True(t, stats.Streamed)
+	require.Equal(t, expectedPage, buf.Bytes())
+	require.Equal(t, whole.PixelHash, stats.PixelHash)
+	require.Less(t, stats.PeakBytes, whole.PeakBytes/2)
+
+	blank, err := os.ReadFile("testdata/blank.pdf")
+	require.NoError(t, err)
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, bytes.NewReader(blank), io.Discard,
+		WithColorspace(ColorspaceAuto), WithSkipBlank(0), WithRenderStats(&stats),
+	)
+	require.ErrorIs(t, err, ErrBlankPage)
+	require.True(t, stats.Streamed)
+	require.True(t, stats.Gray)
+}
+
+func TestSaveToPNGOutputCache(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	expectedPage, err := os.ReadFile("testdata/sample_page1.png")
+	require.NoError(t, err)
+
+	// Identical requests arriving together are served by a single render.
+	cache := NewOutputCache(NewMemoryCache(16 << 20))
+	var (
+		wg      sync.WaitGroup
+		mutex   sync.Mutex
+		renders int
+	)
+	for i := 0; i < 50; i++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			var stats RenderStats
+			buf := bytes.NewBuffer([]byte{})
+			err := SaveToPNG(
+				context.Background(), 1, 0, 0, 0, bytes.NewReader(payload), buf,
+				WithOutputCache(cache), WithRenderStats(&stats),
+			)
+			assert.NoError(t, err)
+			assert.Equal(t, expectedPage, buf.Bytes())
+			if !stats.Cached {
+				mutex.Lock()
+				renders++
+				mutex.Unlock()
+			}
+		}()
+	}
+	wg.Wait()
+	require.Equal(t, 1, renders)
+
+	// The directory cache outlives the OutputCache that filled it.
+	dir := t.TempDir()
+	for _, cached := range []bool{false, true} {
+		store, err := NewDirectoryCache(dir)
+		require.NoError(t, err)
+		var stats RenderStats
+		buf := bytes.NewBuffer([]byte{})
+		err = SaveToPNG(
+			context.Background(), 1, 0, 0, 0, bytes.NewReader(payload), buf,
+			WithOutputCache(NewOutputCache(store)), WithRenderStats(&stats),
+		)
+		require.NoError(t, err)
+		require.Equal(t, cached, stats.Cached)
+		require.Equal(t, expectedPage, buf.Bytes())
+	}
+
+	// Failures are not cached.
+	invalid, err := os.ReadFile("testdata/sample-invalid.pdf")
+	require.NoError(t, err)
+	for i := 0; i < 2; i++ {
+		err = SaveToPNG(
+			context.Background(), 0, 0, 0, 0, bytes.NewReader(invalid), bytes.NewBuffer([]byte{}), WithOutputCache(cache),
+		)
+		require.Error(t, err)
+	}
+
+	// An empty payload fails before reaching the cache or the C layer.
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, bytes.NewReader(nil), bytes.NewBuffer([]byte{}), WithOutputCache(cache),
+	)
+	require.EqualError(t, err, "payload can't be empty")
+
+	// A render that panics releases the callers waiting on it.
+	require.Panics(t, func() {
+		_, _, _ = cache.do(context.Background(), "panic", func() ([]byte, bool, error) { panic("render") })
+	})
+	value, cached, err := cache.do(context.Background(), "panic", func() ([]byte, bool, error) {
+		return []byte("value"), false, nil
+	})
+	require.NoError(t, err)
+	require.False(t, cached)
+	require.Equal(t, []byte("value"), value)
+}
+
+func TestMemoryCache(t *testing.T) {
+	cache := NewMemoryCache(10)
+	cache.Set("a", []byte("1234"))
+	cache.Set("b", []byte("5678"))
+	_, ok := cache.Get("a")
+	require.True(t, ok)
+
+	// b is the least recently used.
+	cache.Set("c", []byte("90"))
+	cache.Set("d", []byte("12"))
+	_, ok = cache.Get("b")
+	require.False(t, ok)
+	value, ok := cache.Get("a")
+	require.True(t, ok)
+	require.Equal(t, []byte("1234"), value)
+
+	cache.Set("e", []byte("12345678901"))
+	_, ok = cache.Get("e")
+	require.False(t, ok)
+}
+
+func TestSaveToPNGContentHash(t *testing.T) {
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	documentHash := sha256.Sum256(payload)
+
+	var hashes []string
+	for i := 0; i < 2; i++ {
+		var stats RenderStats
+		err = SaveToPNG(
+			context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), bytes.NewBuffer([]byte{}),
+			WithContentHash(), WithRenderStats(&stats),
+		)
+		require.NoError(t, err)
+		require.Equal(t, hex.EncodeToString(documentHash[:]), stats.DocumentHash)
+		require.Len(t, stats.PixelHash, 32)
+		hashes = append(hashes, stats.PixelHash)
+	}
+	require.Equal(t, hashes[0], hashes[1])
+
+	// A new version of the document with the same page reuses the cached output instead of encoding it.
+	cache := NewOutputCache(NewMemoryCache(16 << 20))
+	var stats RenderStats
+	expected := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), expected,
+		WithOutputCache(cache), WithRenderStats(&stats),
+	)
+	require.NoError(t, err)
+	require.False(t, stats.Deduplicated)
+	require.Equal(t, hashes[0], stats.PixelHash)
+
+	version := append(append([]byte{}, payload...), []byte("\n% new version\n")...)
+	buf := bytes.NewBuffer([]byte{})
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, bytes.NewReader(version), buf,
+		WithOutputCache(cache), WithRenderStats(&stats),
+	)
+	require.NoError(t, err)
+	require.False(t, stats.Cached)
+	require.True(t, stats.Deduplicated)
+	require.Zero(t, stats.Encode)
+	require.Equal(t, hashes[0], stats.PixelHash)
+	require.Equal(t, expected.Bytes(), buf.Bytes())
+
+	err = SaveToPNG(
+		context.Background(), 0, 0, 0, 0, bytes.NewReader(version), bytes.NewBuffer([]byte{}),
+		WithOutputCache(cache), WithRenderStats(&stats),
+	)
+	require.NoError(t, err)
+	require.True(t, stats.Cached)
+	require.Equal(t, hashes[0], stats.PixelHash)
+}
+
+// countingReaderAt counts the bytes read from a file.
+type countingReaderAt struct {
+	file  io.ReaderAt
+	mutex sync.Mutex
+	bytes int
+}
+
+func (r *countingReaderAt) ReadAt(p []byte, off int64) (int, error) {
+	n, err := r.file.ReadAt(p, off)
+	r.mutex.Lock()
+	r.bytes += n
+	r.mutex.Unlock()
+	return n, err
+}
+
+func TestRangeReader(t *testing.T) {
+	file, err := os.Open("testdata/sample.pdf")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, file.Close()) }()
+	info, err := file.Stat()
+	require.NoError(t, err)
+
+	reader := &countingReaderAt{file: file}
+	count, err := PageCount(context.Background(), NewRangeReader(reader, info.Size()))
+	require.NoError(t, err)
+	require.Equal(t, 13, count)
+	require.Less(t, reader.bytes, int(info.Size()))
+
+	for _, page := range []uint16{0, 12} {
+		reader = &countingReaderAt{file: file}
+		buf := bytes.NewBuffer([]byte{})
+		err = SaveToPNG(context.Background(), page, 0, 0, 0, NewRangeReader(reader, info.Size()), buf)
+		require.NoError(t, err)
+		require.Less(t, reader.bytes, int(info.Size()))
+
+		expectedPage, err := os.ReadFile(fmt.Sprintf("testdata/sample_page%d.png", page))
+		require.NoError(t, err)
+		require.Equal(t, expectedPage, buf.Bytes())
+	}
+}
+
+// failingReaderAt fails every read past the first block.
+type failingReaderAt struct {
+	file *os.File
+}
+
+func (r failingReaderAt) ReadAt(p []byte, off int64) (int, error) {
+	if off > 0 {
+		return 0, errors.New("connection reset")
+	}
+	return r.file.ReadAt(p, off)
+}
+
+func TestRangeReaderFail(t *testing.T) {
+	file, err := os.Open("testdata/sample.pdf")
+	require.NoError(t, err)
+	defer func() { require.NoError(t, file.Close()) }()
+	info, err := file.Stat()
+	require.NoError(t, err)
+
+	_, err = PageCount(context.Background(), NewRangeReader(failingReaderAt{file: file}, info.Size()))
+	require.Error(t, err)
+	require.Equal(t, "fail to read the payload: connection reset", err.Error())
+}
+
+// linearizedPDF builds a linearized document with one line of text per page. The first page section holds the
+// catalog, the root of the page tree, the node with the first page, the first page itself, its content and the font,
+// the other pages and nodes follow it. With outside set the content of the first page is the one of the last page,
+// which lives outside of the first page section.
+func linearizedPDF(pages int, outside bool) []byte {
+	const pagesPerNode = 100
+	nodes := (pages + pagesPerNode - 1) / pagesPerNode
+	// Objects of the main section: a page and its content for every page but the first, then every node but the first.
+	mainObjects := 2*(pages-1) + nodes - 1
+	node := func(i int) int { return 2*(pages-1) + i }
+	lin, catalog, root, firstNode, firstPage, firstContent, font, hint := mainObjects+1, mainObjects+2,
+		mainObjects+3, mainObjects+4, mainObjects+5, mainObjects+6, mainObjects+7, mainObjects+8
+	size := hint + 1
+	if nodes == 1 {
+		node = func(int) int { return firstNode }
+	}
+	nodeOf := func(page int) int {
+		if page/pagesPerNode == 0 {
+			return firstNode
+		}
+		return node(page / pagesPerNode)
+	}
+
+	// The document is written until the offsets stop changing, every number that depends on them has a fixed width.
+	offsets := make([]int, size)
+	var firstXref, mainXref, hintStart, hintLength, firstEnd int
+	var payload []byte
+	for {
+		var buf bytes.Buffer
+		written := make([]int, size)
+		object := func(num int, format string, args ...any) {
+			written[num] = buf.Len()
+			fmt.Fprintf(&buf, "%d 0 obj\n%s\nendobj\n", num, fmt.Sprintf(format, args...))
+		}
+		stream := func(num int, content string) {
+			object(num, "<</Length %d>>\nstream\n%s\nendstream", len(content), content)
+		}
+		page := func(num, parent, content int) {
+			object(num, "<</Type/Page/Parent %d 0 R/MediaBox [0 0 612 792]/Contents %d 0 R/Resources <</Font <</F1 %d 0 R>>>>>>",
+				parent, content, font)
+		}
+		kids := func(first, last int, ref func(int) int) string {
+			var kids bytes.Buffer
+			for i := first; i < last; i++ {
+				fmt.Fprintf(&kids, "%d 0 R ", ref(i))
+			}
+			return kids.String()
+		}
+		pageRef := func(page int) int {
+			if page == 0 {
+				return firstPage
+			}
+			return 2*page - 1
+		}
+		pageNode := func(num, first int) {
+			last := min(first+pagesPerNode, pages)
+			object(num, "<</Type/Pages/Parent %d 0 R/Count %d/Kids [%s]>>", root, last-first, kids(first, last, pageRef))
+		}
+
+		buf.WriteString("%PDF-1.7\n%\xe2\xe3\xcf\xd3\n")
+		object(lin, "<</Linearized 1/L %010d/H [%010d %010d]/O %d/E %010d/N %d/T %010d>>",
+			len(payload), hintStart, hintLength, firstPage, firstEnd, pages, mainXref)
+		firstXref = buf.Len()
+		fmt.Fprintf(&buf, "xref\n%d %d\n", lin, size-lin)
+		for num := lin; num < size; num++ {
+			fmt.Fprintf(&buf, "%010d 00000 n \n", offsets[num])
+		}
+		fmt.Fprintf(&buf, "trailer\n<</Size %d/Root %d 0 R/Prev %010d>>\nstartxref\n0\n%%%%EOF\n", size, catalog, mainXref)
+		object(catalog, "<</Type/Catalog/Pages %d 0 R>>", root)
+		object(root, "<</Type/Pages/Count %d/Kids [%s]>>", pages, kids(0, nodes, func(i int) int {
+			if i == 0 {
+				return firstNode
+			}
+			return node(i)
+		}))
+		pageNode(firstNode, 0)
+		if outside && pages > 1 {
+			page(firstPage, firstNode, 2*(pages-1))
+		} else {
+			page(firstPage, firstNode, firstContent)
+		}
+		stream(firstContent, "BT /F1 48 Tf 72 600 Td (Page 1) Tj ET")
+		object(font, "<</Type/Font/Subtype/Type1/BaseFont/Helvetica>>")
+		hintStart = buf.Len()
+		stream(hint, "\x00\x00\x00\x00")
+		hintLength = buf.Len() - hintStart
+		firstEnd = buf.Len()
+
+		for i := 1; i < pages; i++ {
+			page(2*i-1, nodeOf(i), 2*i)
+			stream(2*i, fmt.Sprintf("BT /F1 48 Tf 72 600 Td (Page %d) Tj ET", i+1))
+		}
+		for i := 1; i < nodes; i++ {
+			pageNode(node(i), i*pagesPerNode)
+		}
+		mainXref = buf.Len()
+		fmt.Fprintf(&buf, "xref\n0 %d\n0000000000 65535 f \n", mainObjects+1)
+		for num := 1; num <= mainObjects; num++ {
+			fmt.Fprintf(&buf, "%010d 00000 n \n", written[num])
+		}
+		fmt.Fprintf(&buf, "trailer\n<</Size %d>>\nstartxref\n%010d\n%%%%EOF\n", size, firstXref)
+
+		stable := buf.Len() == len(payload) && slices.Equal(written[lin:], offsets[lin:])
+		payload, offsets = buf.Bytes(), written
+		if stable {
+			return payload
+		}
+	}
+}
+
+func TestSaveToPNGLinearized(t *testing.T) {
+	render := func(payload []byte, page uint16) ([]byte, RenderStats, int) {
+		var stats RenderStats
+		reader := &countingReaderAt{file: bytes.NewReader(payload)}
+		buf := bytes.NewBuffer([]byte{})
+		err := SaveToPNG(
+			context.Background(), page, 0, 0, 0, NewRangeReader(reader, int64(len(payload))), buf, WithRenderStats(&stats),
+		)
+		require.NoError(t, err)
+		return buf.Bytes(), stats, reader.bytes
+	}
+
+	// A document updated after it was linearized is read the regular way, which is what an appended byte looks like.
+	payload := linearizedPDF(10_000, false)
+	regular, stats, _ := render(append(slices.Clone(payload), '\n'), 0)
+	require.False(t, stats.Linear)
+
+	linear, stats, read := render(payload, 0)
+	require.True(t, stats.Linear)
+	require.Less(t, read, len(payload)/10)
+	require.Equal(t, regular, linear)
+
+	_, stats, _ = render(payload, 1)
+	require.False(t, stats.Linear)
+
+	// The content of the first page is outside of the first page section, the render falls back to the regular way.
+	payload = linearizedPDF(1_000, true)
+	regular, _, _ = render(append(slices.Clone(payload), '\n'), 0)
+	linear, stats, _ = render(payload, 0)
+	require.False(t, stats.Linear)
+	require.Equal(t, regular, linear)
+
+	// The sample is linearized too.
+	payload, err := os.ReadFile("testdata/sample.pdf")
+	require.NoError(t, err)
+	_, stats, _ = render(payload, 0)
+	require.True(t, stats.Linear)
+
+	// Payloads held in memory are always read the regular way.
+	err = SaveToPNG(context.Background(), 0, 0, 0, 0, bytes.NewReader(payload), io.Discard, WithRenderStats(&stats))
+	require.NoError(t, err)
+	require.False(t, stats.Linear)
+}
+
+// BenchmarkSaveToPNGLinearized renders the first page of linearized documents of growing size, the linear renders
+// should take about the same time whatever the size while the regular ones grow with it. The fallback renders pay for
+// the first page section on top of a regular render.
+func BenchmarkSaveToPNGLinearized(b *testing.B) {
+	for _, pages := range []int{100, 10_000, 100_000} {
+		payload := linearizedPDF(pages, false)
+		for _, mode := range []string{"linear", "regular", "fallback"} {
+			document := payload
+			switch mode {
+			case "regular":
+				document = append(slices.Clone(payload), '\n')
+			case "fallback":
+				// A small document fits in the block holding the end of its first page section, it's always read the
+				// regular way.
+				if pages < 1_000 {
+					continue
+				}
+				document = linearizedPDF(pages, true)
+			}
+			b.Run(fmt.Sprintf("pages=%d/%s", pages, mode), func(b *testing.B) {
+				b.ReportAllocs()
+				for i := 0; i < b.N; i++ {
+					var stats RenderStats
+					reader := NewRangeReader(bytes.NewReader(document), int64(len(document)))
+					err := SaveToPNG(context.Background(), 0, 0, 0, 0, reader, io.Discard, WithRenderStats(&stats))
+					require.NoError(b, err)
+					require.Equal(b, mode == "linear" && pages >= 1_000, stats.Linear)
+				}
+			})
+		}
+	}
 }
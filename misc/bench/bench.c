@@ -0,0 +1,301 @@
+// Native benchmark driver for lazypdf. It calls page_count and save_to_png from main.c directly, without cgo, and
+// prints the results using the Go benchmark format so the output can be compared with `go test -bench` using benchstat.
+#include <errno.h>
+#include <jemalloc/jemalloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "main.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+typedef struct {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+	int fd;
+	uint64_t total;
+} perf_counter;
+
+static perf_counter counters[] = {
+#ifdef __linux__
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1, 0},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1, 0},
+	{"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1, 0},
+	{"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1, 0},
+#endif
+	{NULL, 0, 0, -1, 0},
+};
+
+// main.c calls back into Go for the ranged payloads and the pixel hash lookup, neither is used by the driver.
+int lookupPixelHash(uintptr_t handle, unsigned char *hash) {
+	return 0;
+}
+
+int64_t readPayloadAt(uintptr_t handle, unsigned char *buffer, int64_t length, int64_t offset) {
+	return -1;
+}
+
+static uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void perf_open() {
+#ifdef __linux__
+	for (perf_counter *c = counters; c->name != NULL; c++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = c->type;
+		attr.config = c->config;
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		c->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (c->fd < 0) {
+			fprintf(stderr, "perf_event_open(%s): %s\n", c->name, strerror(errno));
+		}
+	}
+#endif
+}
+
+static void perf_reset() {
+	for (perf_counter *c = counters; c->name != NULL; c++) {
+		c->total = 0;
+	}
+}
+
+static void perf_start() {
+#ifdef __linux__
+	for (perf_counter *c = counters; c->name != NULL; c++) {
+		if (c->fd >= 0) {
+			ioctl(c->fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(c->fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+#endif
+}
+
+static void perf_stop() {
+#ifdef __linux__
+	for (perf_counter *c = counters; c->name != NULL; c++) {
+		uint64_t value = 0;
+		if (c->fd >= 0) {
+			ioctl(c->fd, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(c->fd, &value, sizeof(value)) == sizeof(value)) {
+				c->total += value;
+			}
+		}
+	}
+#endif
+}
+
+typedef struct {
+	uint64_t elapsed;
+	phase_timings timings;
+	render_memory memory;
+} sample;
+
+typedef sample (*bench_fn)(char *payload, size_t payload_length, int page);
+
+static sample run_page_count(char *payload, size_t payload_length, int page) {
+	sample s = {0};
+	page_count_input input = {.payload = payload, .payload_length = payload_length};
+
+	uint64_t mark = now_ns();
+	page_count_output output = page_count(input);
+	s.elapsed = now_ns() - mark;
+
+	if (output.error != NULL) {
+		fprintf(stderr, "page_count: %s\n", output.error);
+		exit(1);
+	}
+	s.timings = output.timings;
+	return s;
+}
+
+static sample run_save_to_png(char *payload, size_t payload_length, int page) {
+	sample s = {0};
+	fz_cookie cookie = {0};
+	save_to_png_input input = {
+		.page = page,
+		.dpi = 72,
+		.payload = payload,
+		.payload_length = payload_length,
+		.cookie = &cookie,
+	};
+
+	uint64_t mark = now_ns();
+	save_to_png_output output = save_to_png(input);
+	s.elapsed = now_ns() - mark;
+
+	if (output.error != NULL) {
+		fprintf(stderr, "save_to_png: %s\n", output.error);
+		exit(1);
+	}
+	je_free(output.payload);
+	s.timings = output.timings;
+	s.memory = output.memory;
+	return s;
+}
+
+// bench mimics testing.B: the iteration count grows until a run takes at least benchtime. The name gets the same
+// -GOMAXPROCS suffix as `go test -bench` on machines with more than one CPU, so benchstat lines them up.
+static void bench(const char *name, bench_fn fn, char *payload, size_t payload_length, int page, uint64_t benchtime, int perf) {
+	uint64_t n = 1;
+	for (;;) {
+		sample total = {0};
+		perf_reset();
+		for (uint64_t i = 0; i < n; i++) {
+			if (perf) {
+				perf_start();
+			}
+			sample s = fn(payload, payload_length, page);
+			if (perf) {
+				perf_stop();
+			}
+			total.elapsed += s.elapsed;
+			total.timings.open += s.timings.open;
+			total.timings.load += s.timings.load;
+			total.timings.run += s.timings.run;
+			total.timings.encode += s.timings.encode;
+			if (s.memory.peak > total.memory.peak) {
+				total.memory.peak = s.memory.peak;
+			}
+			total.memory.allocs += s.memory.allocs;
+		}
+
+		if (total.elapsed >= benchtime || n >= 1000000000) {
+			long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+			if (cpus > 1) {
+				printf("%s-%ld", name, cpus);
+			} else {
+				printf("%s", name);
+			}
+			printf(" \t%10llu\t%10llu ns/op", (unsigned long long)n, (unsigned long long)(total.elapsed / n));
+			if (total.timings.open != 0) {
+				printf("\t%10llu open-ns/op", (unsigned long long)(total.timings.open / n));
+				printf("\t%10llu load-ns/op", (unsigned long long)(total.timings.load / n));
+			}
+			if (total.timings.run != 0) {
+				printf("\t%10llu run-ns/op", (unsigned long long)(total.timings.run / n));
+				printf("\t%10llu encode-ns/op", (unsigned long long)(total.timings.encode / n));
+				printf("\t%10llu peak-native-B", (unsigned long long)total.memory.peak);
+				printf("\t%10llu native-allocs/op", (unsigned long long)(total.memory.allocs / n));
+			}
+			for (perf_counter *c = counters; perf && c->name != NULL; c++) {
+				if (c->fd >= 0) {
+					printf("\t%10llu %s/op", (unsigned long long)(c->total / n), c->name);
+				}
+			}
+			printf("\n");
+			return;
+		}
+
+		// Same growth strategy as the Go testing package: predict the iterations needed with a 20% margin, but never
+		// grow more than 100x at a time.
+		uint64_t per_op = total.elapsed / n;
+		uint64_t next = per_op == 0 ? n * 100 : benchtime * 6 / 5 / per_op;
+		if (next > n * 100) {
+			next = n * 100;
+		}
+		if (next <= n) {
+			next = n + 1;
+		}
+		n = next;
+	}
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr, "usage: %s [-t benchtime_ms] [-p page] [-e] file.pdf\n", argv0);
+	fprintf(stderr, "  -t  minimum duration of each benchmark in milliseconds (default 1000)\n");
+	fprintf(stderr, "  -p  render only the given page, by default every page is rendered\n");
+	fprintf(stderr, "  -e  collect hardware counters with perf_event_open (Linux only)\n");
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	uint64_t benchtime = 1000000000;
+	int only_page = -1;
+	int perf = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:p:e")) != -1) {
+		switch (opt) {
+			case 't':
+				benchtime = strtoull(optarg, NULL, 10) * 1000000;
+				break;
+			case 'p':
+				only_page = atoi(optarg);
+				break;
+			case 'e':
+				perf = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1) {
+		usage(argv[0]);
+	}
+
+	FILE *file = fopen(argv[optind], "rb");
+	if (file == NULL) {
+		fprintf(stderr, "fopen(%s): %s\n", argv[optind], strerror(errno));
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	size_t payload_length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	char *payload = malloc(payload_length);
+	if (fread(payload, 1, payload_length, file) != payload_length) {
+		fprintf(stderr, "fread(%s): short read\n", argv[optind]);
+		return 1;
+	}
+	fclose(file);
+
+	init();
+	if (perf) {
+		perf_open();
+	}
+
+#if defined(__linux__)
+	printf("goos: linux\n");
+#elif defined(__APPLE__)
+	printf("goos: darwin\n");
+#endif
+#if defined(__x86_64__)
+	printf("goarch: amd64\n");
+#elif defined(__aarch64__)
+	printf("goarch: arm64\n");
+#endif
+	printf("pkg: github.com/nitro/lazypdf/v2\n");
+
+	bench("BenchmarkPageCount", run_page_count, payload, payload_length, 0, benchtime, perf);
+
+	page_count_output count = page_count((page_count_input){.payload = payload, .payload_length = payload_length});
+	if (count.error != NULL) {
+		fprintf(stderr, "page_count: %s\n", count.error);
+		return 1;
+	}
+	for (int page = 0; page < count.count; page++) {
+		if (only_page >= 0 && page != only_page) {
+			continue;
+		}
+		char name[64];
+		snprintf(name, sizeof(name), "BenchmarkSaveToPNGPage%d", page);
+		bench(name, run_save_to_png, payload, payload_length, page, benchtime, perf);
+	}
+
+	free(payload);
+	return 0;
+}
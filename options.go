@@ -0,0 +1,211 @@
+package lazypdf
+
+import (
+	"time"
+
+	ddTracer "gopkg.in/DataDog/dd-trace-go.v1/ddtrace/tracer"
+)
+
+// RenderOption is used to customize a single render.
+type RenderOption func(*renderOptions)
+
+type renderOptions struct {
+	stats            *RenderStats
+	progress         func(RenderProgress)
+	progressInterval time.Duration
+	bestEffort       bool
+	bands            int
+	skipBlank        bool
+	maxInk           float64
+	colorspace       Colorspace
+	fitWidth         int
+	fitHeight        int
+	maxPixels        uint64
+	cache            *OutputCache
+	hash             bool
+}
+
+// Colorspace is the colorspace a page is rendered in.
+type Colorspace int
+
+// Supported colorspaces.
+const (
+	// ColorspaceRGB renders the page in RGB with an alpha channel.
+	ColorspaceRGB Colorspace = iota
+
+	// ColorspaceGray renders the page in gray without an alpha channel, it takes a quarter of the memory of RGB.
+	ColorspaceGray
+
+	// ColorspaceAuto renders the page in gray when it has no color and in RGB otherwise. Every pixel of the images and
+	// shadings is checked for color while the page is recorded as a display list.
+	ColorspaceAuto
+)
+
+// RenderStats holds information about a finished render.
+type RenderStats struct {
+	// Errors is the number of errors MuPDF recovered from while interpreting the page. A page can render successfully
+	// and still have a non zero value here, in which case the output is probably missing some content.
+	Errors int
+
+	// Cached is set when the output came from the cache or from an identical render in flight, in which case the
+	// fields about the native render are zero.
+	Cached bool
+
+	// DocumentHash is the hex encoded SHA-256 of the payload and PixelHash the hex encoded MD5 of the rendered pixels,
+	// both filled only with WithContentHash or WithOutputCache. The pixel hash is stable across documents, it's a good
+	// ETag for the output. Deduplicated is set when the pixel hash matched an output at the cache that was reused
+	// instead of encoding the page again.
+	DocumentHash string
+	PixelHash    string
+	Deduplicated bool
+
+	// Gray is set when the page was rendered in gray.
+	Gray bool
+
+	// Clamped is set when the scale was reduced to respect WithMaxPixels.
+	Clamped bool
+
+	// Streamed is set when the page was drawn and encoded in bands because it was above the SetStreamThreshold size.
+	Streamed bool
+
+	// Linear is set when the first page of a linearized document read through a RangeReader was rendered from its first
+	// page section alone, without reading the rest of the document.
+	Linear bool
+
+	// GlyphCacheBytes is the size of the glyph cache once the page was drawn. The cache is shared with the renders in
+	// flight and MuPDF empties it at 1 MiB, text heavy pages at large scales that get close to it don't benefit from it.
+	GlyphCacheBytes uint64
+
+	// Incomplete is set when a best effort render was interrupted by the context and the output holds only the part of
+	// the page that was drawn until then.
+	Incomplete bool
+
+	// Time spent at each phase of the render. Read and Write are the time spent by Go reading the payload and writing
+	// the result, the others are measured by the C layer.
+	Read   time.Duration
+	Open   time.Duration
+	Load   time.Duration
+	Run    time.Duration
+	Encode time.Duration
+	Write  time.Duration
+
+	// Memory allocated by MuPDF on behalf of the render. PeakBytes is the highest amount held at once, TotalBytes the sum
+	// of every allocation and Allocs the number of allocations.
+	PeakBytes  uint64
+	TotalBytes uint64
+	Allocs     uint64
+}
+
+func (s RenderStats) tag(span ddTracer.Span) {
+	span.SetTag("lazypdf.errors", s.Errors)
+	span.SetTag("lazypdf.incomplete", s.Incomplete)
+	span.SetTag("lazypdf.cached", s.Cached)
+	span.SetTag("lazypdf.gray", s.Gray)
+	span.SetTag("lazypdf.clamped", s.Clamped)
+	span.SetTag("lazypdf.streamed", s.Streamed)
+	span.SetTag("lazypdf.linear", s.Linear)
+	span.SetTag("lazypdf.deduplicated", s.Deduplicated)
+	span.SetTag("lazypdf.glyph_cache_bytes", s.GlyphCacheBytes)
+	span.SetTag("lazypdf.phase.read_ns", s.Read.Nanoseconds())
+	span.SetTag("lazypdf.phase.open_ns", s.Open.Nanoseconds())
+	span.SetTag("lazypdf.phase.load_ns", s.Load.Nanoseconds())
+	span.SetTag("lazypdf.phase.run_ns", s.Run.Nanoseconds())
+	span.SetTag("lazypdf.phase.encode_ns", s.Encode.Nanoseconds())
+	span.SetTag("lazypdf.phase.write_ns", s.Write.Nanoseconds())
+	span.SetTag("lazypdf.memory.peak_bytes", s.PeakBytes)
+	span.SetTag("lazypdf.memory.total_bytes", s.TotalBytes)
+	span.SetTag("lazypdf.memory.allocs", s.Allocs)
+}
+
+// RenderProgress is a snapshot of the progress of a render in flight.
+type RenderProgress struct {
+	// Progress increments as the page is interpreted. A render in bands first records the page, then reports the average
+	// progress of its bands.
+	Progress int
+
+	// ProgressMax is the known upper bound of Progress or -1 when it's not known.
+	ProgressMax int
+
+	// Errors is the number of errors MuPDF recovered from so far.
+	Errors int
+}
+
+// WithRenderStats fills stats once the render finishes, even if it fails.
+func WithRenderStats(stats *RenderStats) RenderOption {
+	return func(o *renderOptions) { o.stats = stats }
+}
+
+// WithProgress calls fn with the render progress at every interval while the render is running and one last time
+// when it finishes. The function is called from a different goroutine than the one doing the render.
+func WithProgress(interval time.Duration, fn func(RenderProgress)) RenderOption {
+	return func(o *renderOptions) {
+		o.progress = fn
+		o.progressInterval = interval
+	}
+}
+
+// WithBestEffort changes what happens when the context is done while the page is being drawn. Instead of failing, the
+// render stops the interpretation and encodes whatever is already drawn. Use it together with WithRenderStats to know
+// if the output is incomplete.
+func WithBestEffort() RenderOption {
+	return func(o *renderOptions) { o.bestEffort = true }
+}
+
+// WithBands splits the drawing of the page in the given number of horizontal bands, drawn in parallel by the worker
+// threads of the C layer, one per CPU and shared by every render. The page is interpreted once into a display list
+// that is shared by every band. It's meant for dense pages rendered at high resolutions, where the drawing dominates
+// the render time. Vector content is drawn exactly as without bands, but images that cross the edge of a band are
+// resampled per band and may differ by a few levels.
+func WithBands(bands int) RenderOption {
+	return func(o *renderOptions) { o.bands = bands }
+}
+
+// WithSkipBlank makes SaveToPNG return ErrBlankPage instead of encoding the page when at most maxInk of the rendered
+// pixels, from 0 to 1, have ink. A maxInk of 0 only skips pages where nothing visible is drawn.
+func WithSkipBlank(maxInk float64) RenderOption {
+	return func(o *renderOptions) {
+		o.skipBlank = true
+		o.maxInk = maxInk
+	}
+}
+
+// WithColorspace sets the colorspace the page is rendered in, the default is ColorspaceRGB.
+func WithColorspace(colorspace Colorspace) RenderOption {
+	return func(o *renderOptions) { o.colorspace = colorspace }
+}
+
+// WithFit scales the page to the largest size that fits within width x height pixels, at the resolution given by the
+// dpi, keeping its aspect ratio. It takes precedence over the width and scale given to SaveToPNG. A zero dimension is
+// unbounded.
+func WithFit(width, height int) RenderOption {
+	return func(o *renderOptions) {
+		o.fitWidth = width
+		o.fitHeight = height
+	}
+}
+
+// WithMaxPixels caps the size of the rendered page. When the page would take more than maxPixels pixels its scale is
+// reduced until it fits, whatever the other parameters asked for, which keeps the memory of a render predictable even
+// for pages with absurd sizes. RenderStats.Clamped is set when the scale was reduced.
+func WithMaxPixels(maxPixels uint64) RenderOption {
+	return func(o *renderOptions) { o.maxPixels = maxPixels }
+}
+
+// WithOutputCache serves the render from the cache when an identical one, same payload and parameters, was already done
+// and coalesces it with identical renders in flight.
+func WithOutputCache(cache *OutputCache) RenderOption {
+	return func(o *renderOptions) { o.cache = cache }
+}
+
+// WithContentHash fills the document and pixel hashes of RenderStats.
+func WithContentHash() RenderOption {
+	return func(o *renderOptions) { o.hash = true }
+}
+
+func newRenderOptions(opts []RenderOption) renderOptions {
+	var o renderOptions
+	for _, opt := range opts {
+		opt(&o)
+	}
+	return o
+}
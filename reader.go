@@ -0,0 +1,87 @@
+package lazypdf
+
+/*
+#include "main.h"
+*/
+import "C"
+
+import (
+	"errors"
+	"fmt"
+	"io"
+	"runtime/cgo"
+	"unsafe"
+)
+
+// RangeReader is a payload read on demand, meant for documents at object storage. SaveToPNG and PageCount fetch only
+// the byte ranges MuPDF touches, in blocks of 64 KiB with the most recent ones cached for the duration of the call.
+// Everything else, and SaveToPNG with an output cache or content hashes, reads it whole as any other io.Reader. The
+// first page of a linearized document is rendered from its first page section alone, unless the page needs objects
+// from outside of it.
+type RangeReader struct {
+	*io.SectionReader
+}
+
+// NewRangeReader creates a RangeReader for the first size bytes of reader.
+func NewRangeReader(reader io.ReaderAt, size int64) *RangeReader {
+	return &RangeReader{SectionReader: io.NewSectionReader(reader, 0, size)}
+}
+
+// payloadSource is a payload handed to the C layer, either in memory or read on demand from a RangeReader.
+type payloadSource struct {
+	data   []byte
+	ranged *RangeReader
+	err    error
+}
+
+// readPayload reads the payload to memory unless it's a RangeReader and ranged reads are allowed.
+func readPayload(rawPayload io.Reader, ranged bool) (*payloadSource, error) {
+	if reader, ok := rawPayload.(*RangeReader); ok && ranged {
+		if reader.Size() == 0 {
+			return nil, errors.New("payload can't be empty")
+		}
+		return &payloadSource{ranged: reader}, nil
+	}
+
+	data, err := io.ReadAll(rawPayload)
+	if err != nil {
+		return nil, fmt.Errorf("fail to read the payload: %w", err)
+	}
+	if len(data) == 0 {
+		return nil, errors.New("payload can't be empty")
+	}
+	return &payloadSource{data: data}, nil
+}
+
+// bind returns the C fields that describe the payload. The returned function must be called once the C layer is done
+// with it.
+func (p *payloadSource) bind() (payload *C.char, length C.size_t, reader C.uintptr_t, release func()) {
+	if p.ranged == nil {
+		return (*C.char)(unsafe.Pointer(&p.data[0])), C.size_t(len(p.data)), 0, func() {}
+	}
+	handle := cgo.NewHandle(p)
+	return nil, C.size_t(p.ranged.Size()), C.uintptr_t(handle), handle.Delete
+}
+
+// check returns the error of a failed read, if any, or err. MuPDF may recover from a failed read by repairing the
+// document with what it could read, so the read error takes precedence even when the call succeeded.
+func (p *payloadSource) check(err error) error {
+	if p.err != nil {
+		return fmt.Errorf("fail to read the payload: %w", p.err)
+	}
+	return err
+}
+
+// readPayloadAt is called by the C layer to fill a block of the payload. It returns the number of bytes read, short
+// only at the end of the payload, or -1 on failure.
+//
+//export readPayloadAt
+func readPayloadAt(handle C.uintptr_t, buffer *C.uchar, length, offset C.int64_t) C.int64_t {
+	p := cgo.Handle(handle).Value().(*payloadSource) // nolint: forcetypeassert
+	n, err := p.ranged.ReadAt(unsafe.Slice((*byte)(unsafe.Pointer(buffer)), int(length)), int64(offset))
+	if err != nil && !errors.Is(err, io.EOF) {
+		p.err = err
+		return -1
+	}
+	return C.int64_t(n)
+}
@@ -0,0 +1,131 @@
+package lazypdf
+
+/*
+#include <jemalloc/jemalloc.h>
+#include "main.h"
+*/
+import "C"
+
+import (
+	"context"
+	"errors"
+	"fmt"
+	"io"
+	"unsafe"
+
+	ddTracer "gopkg.in/DataDog/dd-trace-go.v1/ddtrace/tracer"
+)
+
+// ImageFormat is the encoding of a rendered page.
+type ImageFormat int
+
+// Supported image formats.
+const (
+	PNG ImageFormat = iota
+	JPEG
+)
+
+const defaultJPEGQuality = 90
+
+// RenditionSpec describes one of the outputs of RenderRenditions. Width, Scale and DPI follow the same rules as the
+// SaveToPNG parameters.
+type RenditionSpec struct {
+	Width  uint16
+	Scale  float32
+	DPI    int
+	Format ImageFormat
+
+	// Quality is used by JPEG and goes from 1 to 100, the default is 90.
+	Quality int
+
+	// MaxPixels caps the size of the rendition like WithMaxPixels does for SaveToPNG, zero is unbounded.
+	MaxPixels uint64
+}
+
+// RenderRenditions renders a page at many sizes and formats while interpreting it only once. The page is recorded as a
+// display list and every rendition is drawn from it, in parallel when there are enough cores. The outputs are returned
+// in the same order as the specs.
+func RenderRenditions(
+	ctx context.Context, page uint16, rawPayload io.Reader, specs []RenditionSpec,
+) (_ [][]byte, err error) {
+	span, _ := ddTracer.StartSpanFromContext(ctx, "lazypdf.RenderRenditions")
+	defer func() { span.Finish(ddTracer.WithError(err)) }()
+
+	if rawPayload == nil {
+		return nil, errors.New("payload can't be nil")
+	}
+	if len(specs) == 0 {
+		return nil, errors.New("at least one rendition is required")
+	}
+
+	payload, err := io.ReadAll(rawPayload)
+	if err != nil {
+		return nil, fmt.Errorf("fail to read the payload: %w", err)
+	}
+
+	cspecs := make([]C.rendition_spec, len(specs))
+	for i, spec := range specs {
+		cspecs[i] = C.rendition_spec{
+			width:      C.int(spec.Width),
+			scale:      C.float(spec.Scale),
+			dpi:        C.int(max(spec.DPI, defaultDPI)),
+			format:     C.FORMAT_PNG,
+			quality:    C.int(spec.Quality),
+			max_pixels: C.uint64_t(spec.MaxPixels),
+		}
+		if spec.Format == JPEG {
+			cspecs[i].format = C.FORMAT_JPEG
+		}
+		if spec.Quality <= 0 || spec.Quality > 100 {
+			cspecs[i].quality = defaultJPEGQuality
+		}
+	}
+
+	// The cookies live in C memory as the worker threads keep reading them while Go flips the abort flags.
+	cookiesLength := len(specs) + 1
+	cookies := (*C.fz_cookie)(C.je_calloc(C.size_t(cookiesLength), C.sizeof_fz_cookie))
+	if cookies == nil {
+		return nil, errors.New("fail to allocate the cookies")
+	}
+	defer C.je_free(unsafe.Pointer(cookies))
+	stop := abortOnDone(ctx, unsafe.Slice(cookies, cookiesLength))
+	defer stop()
+
+	input := C.render_renditions_input{
+		page:           C.int(page),
+		payload:        (*C.char)(unsafe.Pointer(&payload[0])),
+		payload_length: C.size_t(len(payload)),
+		specs:          &cspecs[0],
+		specs_length:   C.int(len(specs)),
+		cookies:        cookies,
+	}
+	result := C.render_renditions(input) // nolint: gocritic
+	// The outputs are missing when their allocation failed.
+	var outputs []C.rendition_output
+	if result.outputs != nil {
+		outputs = unsafe.Slice(result.outputs, len(specs))
+	}
+	defer func() {
+		for _, output := range outputs {
+			C.je_free(unsafe.Pointer(output.payload))
+			C.je_free(unsafe.Pointer(output.error))
+		}
+		C.je_free(unsafe.Pointer(result.outputs))
+		C.je_free(unsafe.Pointer(result.error))
+	}()
+	if result.error != nil {
+		if result.aborted != 0 {
+			return nil, fmt.Errorf("failure at the C/MuPDF layer: %s: %w", C.GoString(result.error), context.Cause(ctx))
+		}
+		return nil, fmt.Errorf("failure at the C/MuPDF layer: %s", C.GoString(result.error))
+	}
+
+	renditions := make([][]byte, len(specs))
+	for i, output := range outputs {
+		if output.error != nil {
+			return nil, fmt.Errorf("failure at the C/MuPDF layer: rendition %d: %s", i, C.GoString(output.error))
+		}
+		renditions[i] = C.GoBytes(unsafe.Pointer(output.payload), C.int(output.payload_length))
+	}
+	return renditions, nil
+}
@@ -0,0 +1,171 @@
+package lazypdf
+
+// #include "main.h"
+import "C"
+
+import (
+	"expvar"
+	"fmt"
+	"time"
+)
+
+// EngineStats is a snapshot of the process wide state of the native engine.
+type EngineStats struct {
+	// Memory allocated by MuPDF through the tracing allocator.
+	Memory MemoryStats `json:"memory"`
+
+	// Resource store, the cache MuPDF keeps for decoded objects like fonts and images.
+	StoreLimit uint64 `json:"store_limit"`
+	StoreSize  uint64 `json:"store_size"`
+
+	// GlyphCacheSize is the amount of memory used by rendered glyphs. MuPDF empties the cache whenever a document is
+	// dropped, it's only non zero while renders are in flight.
+	GlyphCacheSize uint64 `json:"glyph_cache_size"`
+
+	// Jemalloc statistics, check the jemalloc documentation for the meaning of each one.
+	Jemalloc JemallocStats `json:"jemalloc"`
+
+	// PixmapPool holds the state of the pool of pixmap sample buffers.
+	PixmapPool PixmapPoolStats `json:"pixmap_pool"`
+
+	// Shards is the number of independent MuPDF base contexts, set with LAZYPDF_SHARDS. The memory, store, glyph cache
+	// and lock counters are the sum of every shard, the memory counters also include the pixmap pool buffers.
+	Shards int `json:"shards"`
+
+	// LockSpinning is set when the MuPDF global locks spin before blocking, with LAZYPDF_LOCKS=spin. Locks holds their
+	// counters, only collected with LAZYPDF_LOCK_STATS=1.
+	LockSpinning bool        `json:"lock_spinning"`
+	Locks        []LockStats `json:"locks,omitempty"`
+
+	// Number of calls in flight at the C layer. ActiveRenders counts SaveToPNG, RenderRenditions, IsBlank and
+	// ContentBounds, ActivePageCounts PageCount and each document of a PageCounts batch being counted.
+	ActiveRenders    int `json:"active_renders"`
+	ActivePageCounts int `json:"active_page_counts"`
+
+	// QueuedTasks is the number of banded renders, RenderRenditions calls and PageCounts batches waiting for the worker
+	// threads, QueuedCalls the number of their bands, renditions and documents no thread took yet.
+	QueuedTasks int `json:"queued_tasks"`
+	QueuedCalls int `json:"queued_calls"`
+}
+
+// MemoryStats holds the counters of the tracing allocator used by MuPDF.
+type MemoryStats struct {
+	Current uint64 `json:"current"`
+	Peak    uint64 `json:"peak"`
+	Total   uint64 `json:"total"`
+	Allocs  uint64 `json:"allocs"`
+}
+
+// JemallocStats holds the process wide jemalloc counters.
+type JemallocStats struct {
+	Allocated uint64 `json:"allocated"`
+	Active    uint64 `json:"active"`
+	Resident  uint64 `json:"resident"`
+	Retained  uint64 `json:"retained"`
+	Mapped    uint64 `json:"mapped"`
+
+	// Arenas is the number of arenas dedicated to MuPDF, ArenasDirty and ArenasMuzzy the bytes in unused pages they
+	// hold that were not yet returned to the operating system.
+	Arenas      int    `json:"arenas"`
+	ArenasDirty uint64 `json:"arenas_dirty"`
+	ArenasMuzzy uint64 `json:"arenas_muzzy"`
+}
+
+// PixmapPoolStats holds the counters of the pool of pixmap sample buffers.
+type PixmapPoolStats struct {
+	Limit    uint64 `json:"limit"`
+	Retained uint64 `json:"retained"`
+	Hits     uint64 `json:"hits"`
+	Misses   uint64 `json:"misses"`
+}
+
+// LockStats holds the counters of one of the MuPDF global locks. Contended is the number of acquisitions that found the
+// lock taken, Wait the time spent waiting for it and Hold the time it was held.
+type LockStats struct {
+	Name         string        `json:"name"`
+	Acquisitions uint64        `json:"acquisitions"`
+	Contended    uint64        `json:"contended"`
+	Wait         time.Duration `json:"wait_ns"`
+	Hold         time.Duration `json:"hold_ns"`
+}
+
+// Stats returns a snapshot of the native engine state. It only reads counters, so it's cheap enough to be called
+// periodically while renders are running.
+func Stats() EngineStats {
+	stats := C.get_engine_stats()
+	return EngineStats{
+		Memory: MemoryStats{
+			Current: uint64(stats.memory.current),
+			Peak:    uint64(stats.memory.peak),
+			Total:   uint64(stats.memory.total),
+			Allocs:  uint64(stats.memory.allocs),
+		},
+		StoreLimit:     uint64(stats.store_max),
+		StoreSize:      uint64(stats.store_size),
+		GlyphCacheSize: uint64(stats.glyph_cache_size),
+		Jemalloc: JemallocStats{
+			Allocated: uint64(stats.allocated),
+			Active:    uint64(stats.active),
+			Resident:  uint64(stats.resident),
+			Retained:  uint64(stats.retained),
+			Mapped:    uint64(stats.mapped),
+
+			Arenas:      int(stats.arenas),
+			ArenasDirty: uint64(stats.arenas_dirty),
+			ArenasMuzzy: uint64(stats.arenas_muzzy),
+		},
+		PixmapPool: PixmapPoolStats{
+			Limit:    uint64(stats.pixmap_pool_limit),
+			Retained: uint64(stats.pixmap_pool_retained),
+			Hits:     uint64(stats.pixmap_pool_hits),
+			Misses:   uint64(stats.pixmap_pool_misses),
+		},
+		Shards:           int(stats.shards),
+		LockSpinning:     stats.lock_spinning != 0,
+		Locks:            locksStats(stats),
+		ActiveRenders:    int(stats.active_renders),
+		ActivePageCounts: int(stats.active_page_counts),
+		QueuedTasks:      int(stats.queued_tasks),
+		QueuedCalls:      int(stats.queued_calls),
+	}
+}
+
+func locksStats(stats C.engine_stats) []LockStats {
+	if stats.lock_instrumented == 0 {
+		return nil
+	}
+	locks := make([]LockStats, len(stats.locks))
+	for i, lock := range stats.locks {
+		locks[i] = LockStats{
+			Name:         lockName(i),
+			Acquisitions: uint64(lock.acquisitions),
+			Contended:    uint64(lock.contended),
+			Wait:         time.Duration(lock.wait_ns),
+			Hold:         time.Duration(lock.hold_ns),
+		}
+	}
+	return locks
+}
+
+func lockName(lock int) string {
+	switch lock {
+	case C.FZ_LOCK_ALLOC:
+		return "alloc"
+	case C.FZ_LOCK_FREETYPE:
+		return "freetype"
+	case C.FZ_LOCK_GLYPHCACHE:
+		return "glyphcache"
+	default:
+		return fmt.Sprintf("lock%d", lock)
+	}
+}
+
+// PublishExpvar publishes the engine stats with expvar under the given name. Like expvar.Publish, it panics if the
+// name is already in use.
+func PublishExpvar(name string) {
+	expvar.Publish(name, expvar.Func(func() any { return Stats() }))
+}
+
+func resetNativeMemoryPeak() {
+	C.reset_trace_peak()
+}